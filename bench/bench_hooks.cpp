@@ -0,0 +1,171 @@
+/*
+    Microbenchmarks for the interposed syscalls. Run once plain and once with dcuz.so
+    LD_PRELOADed (see `make bench`); the difference is the per-call overhead of the hooks.
+    Each result is printed as one JSON object per line.
+*/
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <ctime>
+#include <vector>
+
+const size_t PAYLOAD_SIZES[] = {16, 64, 256, 1000, 4096};
+const size_t EPOLL_FD_COUNTS[] = {1, 16, 64, 256};
+
+static const char* mode;
+
+static uint64_t now_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+static void die(const char* what) {
+    perror(what);
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * @brief Creates a connected TCP loopback pair. Goes through connect/accept so both ends are
+ * tracked by the socket hook when it is preloaded.
+ */
+static void tcp_pair(int* client_fd, int* server_fd) {
+    static int listen_fd = -1;
+    static sockaddr_in addr;
+    if (listen_fd == -1) {
+        listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (listen_fd < 0) die("socket");
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = 0;
+        if (bind(listen_fd, (sockaddr*)&addr, sizeof(addr)) < 0) die("bind");
+        if (listen(listen_fd, 512) < 0) die("listen");
+        socklen_t len = sizeof(addr);
+        getsockname(listen_fd, (sockaddr*)&addr, &len);
+    }
+
+    *client_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (*client_fd < 0) die("socket");
+    if (connect(*client_fd, (sockaddr*)&addr, sizeof(addr)) < 0) die("connect");
+    *server_fd = accept(listen_fd, nullptr, nullptr);
+    if (*server_fd < 0) die("accept");
+
+    int one = 1;
+    setsockopt(*client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+/**
+ * @brief Reads exactly `len` bytes. The hooked read hands back at most one packet per call.
+ */
+static void read_full(int fd, char* buf, size_t len) {
+    size_t nread = 0;
+    while (nread < len) {
+        ssize_t n = read(fd, buf + nread, len - nread);
+        if (n <= 0) die("read");
+        nread += n;
+    }
+}
+
+/**
+ * @brief Times one write followed by reading it back on the other end, per payload size.
+ */
+static void bench_read_write(const char* transport, int write_fd, int read_fd, size_t iters) {
+    static char out[4096], in[4096];
+    memset(out, 'x', sizeof(out));
+
+    for (size_t payload : PAYLOAD_SIZES) {
+        // Warm up
+        for (size_t i = 0; i < 100; i++) {
+            ssize_t n = write(write_fd, out, payload);
+            if (n <= 0) die("write");
+            read_full(read_fd, in, n);
+        }
+
+        uint64_t start = now_ns();
+        for (size_t i = 0; i < iters; i++) {
+            ssize_t n = write(write_fd, out, payload);
+            if (n <= 0) die("write");
+            read_full(read_fd, in, n);
+        }
+        uint64_t elapsed = now_ns() - start;
+
+        printf("{\"bench\":\"read_write\",\"mode\":\"%s\",\"transport\":\"%s\",\"payload\":%zu,"
+               "\"iterations\":%zu,\"ns_per_op\":%.1f}\n",
+               mode, transport, payload, iters, double(elapsed) / iters);
+    }
+}
+
+/**
+ * @brief Times a write to one of N connections followed by epoll_pwait and a read of the
+ * ready fd, so every wakeup scans all N tracked fds.
+ */
+static void bench_epoll(size_t nfds, size_t iters) {
+    std::vector<int> clients(nfds), servers(nfds);
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) die("epoll_create1");
+
+    for (size_t i = 0; i < nfds; i++) {
+        tcp_pair(&clients[i], &servers[i]);
+        epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = servers[i];
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, servers[i], &ev) < 0) die("epoll_ctl");
+    }
+
+    char buf[64];
+    memset(buf, 'x', sizeof(buf));
+    epoll_event events[16];
+
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < iters; i++) {
+        ssize_t n = write(clients[i % nfds], buf, sizeof(buf));
+        if (n <= 0) die("write");
+
+        int ready = epoll_pwait(epoll_fd, events, 16, -1, nullptr);
+        if (ready <= 0) die("epoll_pwait");
+        read_full(events[0].data.fd, buf, n);
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    printf("{\"bench\":\"epoll_pwait\",\"mode\":\"%s\",\"tracked_fds\":%zu,"
+           "\"iterations\":%zu,\"ns_per_op\":%.1f}\n",
+           mode, nfds, iters, double(elapsed) / iters);
+
+    for (size_t i = 0; i < nfds; i++) {
+        close(clients[i]);
+        close(servers[i]);
+    }
+    close(epoll_fd);
+}
+
+int main(int argc, char* argv[]) {
+    size_t iters = argc > 1 ? strtoul(argv[1], nullptr, 10) : 20000;
+
+    const char* preload = getenv("LD_PRELOAD");
+    mode = preload && strstr(preload, "dcuz") ? "hooked" : "unhooked";
+
+    int pipe_fds[2];
+    if (pipe(pipe_fds) < 0) die("pipe");
+    bench_read_write("pipe", pipe_fds[1], pipe_fds[0], iters);
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+
+    int client_fd, server_fd;
+    tcp_pair(&client_fd, &server_fd);
+    bench_read_write("tcp_loopback", client_fd, server_fd, iters);
+    close(client_fd);
+    close(server_fd);
+
+    for (size_t nfds : EPOLL_FD_COUNTS) {
+        bench_epoll(nfds, iters);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,97 @@
+/*
+    Microbenchmarks for DCuz internals that don't go through a syscall: draining the perf ring
+    buffer in process_samples, and the MemoryPool/PacketQueue used by the socket hook.
+    Each result is printed as one JSON object per line.
+*/
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <ctime>
+
+#include "../profiler.hpp"
+#include "../utils/mempool.hpp"
+#include "../utils/packetqueue.hpp"
+#include "../utils/time.hpp"
+
+// process_samples and the SIGPROF handler refer to the global profiler
+Profiler p;
+
+static uint64_t thread_cpu_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+volatile uint64_t sink;
+
+/**
+ * @brief Burns CPU so the task clock event produces samples, then times draining them. The
+ * timer period is set far beyond the run so SIGPROF never drains the ring behind our back.
+ */
+static void bench_process_samples(size_t rounds) {
+    if (!p.init(0, 1, 10000, 10, 60000000000ULL) || !p.start()) {
+        fprintf(stderr, "Failed to start profiler, skipping process_samples benchmark\n");
+        return;
+    }
+
+    uint64_t elapsed = 0;
+    size_t records = 0;
+    for (size_t i = 0; i < rounds; i++) {
+        // ~1ms of CPU at a 10us period fills well under the 32KB ring
+        uint64_t until = thread_cpu_ns() + 1000000;
+        while (thread_cpu_ns() < until) sink = sink + 1;
+
+        size_t before = p.get_profile_counts();
+        uint64_t start = now_ns();
+        p.process_samples();
+        elapsed += now_ns() - start;
+        records += p.get_profile_counts() - before;
+    }
+    p.stop();
+
+    printf("{\"bench\":\"process_samples\",\"records\":%zu,\"lost_samples\":%zu,\"ns_per_record\":%.1f}\n",
+           records, p.get_lost_samples(), records ? double(elapsed) / records : 0.0);
+}
+
+static void bench_memory_pool(size_t iters) {
+    MemoryPool pool(1024, 1024);
+    MemoryPoolBuffer* bufs[64];
+
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < iters; i++) {
+        for (int j = 0; j < 64; j++) bufs[j] = pool.get_buf();
+        for (int j = 0; j < 64; j++) pool.return_buf(bufs[j]);
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    printf("{\"bench\":\"memory_pool\",\"operations\":%zu,\"ns_per_op\":%.2f}\n",
+           iters * 128, double(elapsed) / (iters * 128));
+}
+
+static void bench_packet_queue(size_t iters) {
+    PacketQueue* pq = new PacketQueue();
+    Packet packet {};
+
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < iters; i++) {
+        for (int j = 0; j < 64; j++) {
+            packet.len = j;
+            pq->push(packet);
+        }
+        for (int j = 0; j < 64; j++) sink = sink + pq->pop().len;
+    }
+    uint64_t elapsed = now_ns() - start;
+    delete pq;
+
+    printf("{\"bench\":\"packet_queue\",\"operations\":%zu,\"ns_per_op\":%.2f}\n",
+           iters * 128, double(elapsed) / (iters * 128));
+}
+
+int main(int argc, char* argv[]) {
+    size_t iters = argc > 1 ? strtoul(argv[1], nullptr, 10) : 100000;
+
+    bench_process_samples(200);
+    bench_memory_pool(iters);
+    bench_packet_queue(iters);
+    return EXIT_SUCCESS;
+}
@@ -1,6 +1,8 @@
 #define _XOPEN_SOURCE 500
 
 #include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,7 +12,10 @@
 #include <unistd.h>
 #include <ftw.h>
 
-#define N_SERVERS 3 /* Number of servers in the example cluster */
+/* Load options, parsed here for the node count and passed to every server.
+ * See parseLoad in server.c. */
+#define LOAD_OPTIONS "n:s:c:t:r:"
+#define MAX_LOAD_ARGS 16
 
 int unlink_cb(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf)
 {
@@ -53,14 +58,15 @@ static int clearDir(const char *dir)
 
     return 0;
 }
-static void forkServer(const char *topLevelDir, unsigned i, pid_t *pid)
+static void forkServer(const char *topLevelDir, const char *portBase, char **loadArgs, int nLoadArgs, unsigned i, pid_t *pid)
 {
     *pid = fork();
     if (*pid == 0) {
-        char *dir = malloc(strlen(topLevelDir) + strlen("/D") + 1);
-        char *id = malloc(N_SERVERS / 10 + 2);
-        char *argv[] = {"./server", dir, id, NULL};
+        char *dir = malloc(strlen(topLevelDir) + 16);
+        char id[16];
+        char *argv[MAX_LOAD_ARGS + 5];
         char *envp[] = {NULL};
+        int argc = 0;
         int rv;
         sprintf(dir, "%s/%u", topLevelDir, i + 1);
         rv = clearDir(dir);
@@ -68,25 +74,83 @@ static void forkServer(const char *topLevelDir, unsigned i, pid_t *pid)
             abort();
         }
         sprintf(id, "%u", i + 1);
+
+        /* Keep stdout for the cluster's JSON report */
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+
+        argv[argc++] = "./server";
+        for (int j = 0; j < nLoadArgs; j++) {
+            argv[argc++] = loadArgs[j];
+        }
+        argv[argc++] = dir;
+        argv[argc++] = id;
+        argv[argc++] = (char *)portBase;
+        argv[argc] = NULL;
         execve("./server", argv, envp);
     }
 }
 
+/* Prints the leader's stats with the cluster's wall clock time added, as one
+ * JSON object. Only the leader writes stats, into its data dir. */
+static void report(const char *topLevelDir, unsigned nServers, long nsPassed)
+{
+    char path[1024];
+    char stats[4096];
+    unsigned i;
+
+    for (i = 0; i < nServers; i++) {
+        FILE *in;
+        size_t n;
+        snprintf(path, sizeof path, "%s/%u/stats.json", topLevelDir, i + 1);
+        in = fopen(path, "r");
+        if (in == NULL) {
+            continue;
+        }
+        n = fread(stats, 1, sizeof stats - 1, in);
+        fclose(in);
+        stats[n] = '\0';
+        if (n > 0 && stats[0] == '{') {
+            printf("{\"wall_ns\":%ld,%s", nsPassed, stats + 1);
+            return;
+        }
+    }
+    printf("{\"wall_ns\":%ld}\n", nsPassed);
+}
+
 int main(int argc, char *argv[])
 {
     const char *topLevelDir = "/tmp/raft";
-    pid_t pids[N_SERVERS];
+    const char *portBase = "9000";
+    unsigned nServers = 3;
+    pid_t *pids;
     unsigned i;
+    bool badOption = false;
+    int opt;
     int rv;
 
-    if (argc > 2) {
-        printf("usage: example-cluster [<dir>]\n");
+    while ((opt = getopt(argc, argv, LOAD_OPTIONS)) != -1) {
+        if (opt == '?') {
+            badOption = true;
+        } else if (opt == 'n') {
+            nServers = (unsigned)atoi(optarg);
+        }
+    }
+
+    if (badOption || argc - optind > 2 || optind - 1 > MAX_LOAD_ARGS || nServers == 0) {
+        printf("usage: example-cluster [-n nodes] [-s entry size] [-c concurrency] "
+               "[-t ops] [-r rate] [<dir> [<port base>]]\n");
         return 1;
     }
 
-    if (argc == 2) {
-        topLevelDir = argv[1];
+    if (argc - optind >= 1) {
+        topLevelDir = argv[optind];
+    }
+
+    /* Servers listen on <port base> + <id>, so concurrent clusters need distinct bases. */
+    if (argc - optind == 2) {
+        portBase = argv[optind + 1];
     }
+    pids = calloc(nServers, sizeof *pids);
 
     /* Make sure the top level directory exists. */
     rv = clearDir(topLevelDir);
@@ -98,8 +162,9 @@ int main(int argc, char *argv[])
     clock_gettime(CLOCK_MONOTONIC, &start);
 
     /* Spawn the cluster nodes */
-    for (i = 0; i < N_SERVERS; i++) {
-        forkServer(topLevelDir, i, &pids[i]);
+    /* getopt stops at the first positional argument, so the options are argv[1..optind) */
+    for (i = 0; i < nServers; i++) {
+        forkServer(topLevelDir, portBase, argv + 1, optind - 1, i, &pids[i]);
         usleep(1000);
     }
 
@@ -109,13 +174,16 @@ int main(int argc, char *argv[])
     clock_gettime(CLOCK_MONOTONIC, &end);
 
     // Once one child exits, we can terminate the others.
-    for (i = 0; i < N_SERVERS; i++) {
+    for (i = 0; i < nServers; i++) {
         kill(pids[i], SIGINT);
     }
+    // The leader's stats are only complete once it has exited
+    while (waitpid(-1, NULL, 0) > 0);
 
     long billion = 1000000000L;
     long ns_passed = billion * (end.tv_sec - start.tv_sec) + (long)(end.tv_nsec) - (long)(start.tv_nsec);
 
-    printf("%ld\n", ns_passed);
+    report(topLevelDir, nServers, ns_passed);
+    free(pids);
     return 0;
 }
@@ -0,0 +1,166 @@
+#include <time.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+
+#include "delay.hpp"
+#include "profiler.hpp"
+#include "socket_hook.hpp"
+#include "utils/time.hpp"
+
+extern Profiler p;
+extern size_t delay_length_ns;
+
+std::atomic<bool> inject_delays(false);
+
+// Delay every thread should have paid by now
+static std::atomic<uint64_t> global_delay_ns(0);
+// Total time threads spent paused, for the metrics socket
+static std::atomic<uint64_t> paused_ns(0);
+
+// Initial-exec, so the signal handler never has to allocate this thread's copy
+static thread_local std::atomic<uint64_t> local_delay_ns __attribute__((tls_model("initial-exec"))) (0);
+
+// The profiled thread's count, which the collector thread also updates on its behalf
+static std::atomic<uint64_t>* profiled_local_delay = nullptr;
+
+// Credit left by the last thread to wake through each object, hashed by address. Collisions can
+// only hand over credit up to some other waker's count, which was paid when it was left.
+static constexpr size_t CREDIT_SLOTS = 4096;
+static std::atomic<uint64_t> credit[CREDIT_SLOTS];
+
+// Indexed by fd, like fd_metrics
+static constexpr int MAX_EVENTFDS = 1024;
+static std::atomic<bool> eventfds[MAX_EVENTFDS];
+
+// How far past its deadline a sleep typically wakes up. Shorter pauses are spun.
+static uint64_t sleep_overshoot_ns = 0;
+
+/**
+	Pauses for `ns`. Sleeps for all but the expected overshoot, then spins up to the deadline, so
+	short pauses are precise without burning a whole CPU on long ones.
+*/
+static void pause_for(uint64_t ns) {
+	time_ns start = now_ns();
+	time_ns deadline = start + ns;
+	if (ns > sleep_overshoot_ns) {
+		while (sleep_until(deadline - sleep_overshoot_ns) == EINTR);
+	}
+
+	time_ns now;
+	while ((now = now_ns()) < deadline) {
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#endif
+	}
+	paused_ns += now - start;
+}
+
+bool init_delay_injection() {
+	// Take the median overshoot of a few short sleeps
+	uint64_t samples[15];
+	for (uint64_t &sample : samples) {
+		time_ns start = now_ns();
+		sleep_for(10000);
+		time_ns elapsed = now_ns() - start;
+		sample = elapsed > 10000 ? elapsed - 10000 : 0;
+	}
+	std::sort(samples, samples + 15);
+	sleep_overshoot_ns = samples[7];
+
+	profiled_local_delay = &local_delay_ns;
+	inject_delays = true;
+	return true;
+}
+
+static std::atomic<uint64_t> &credit_slot(const void* object) {
+	uintptr_t key = reinterpret_cast<uintptr_t>(object);
+	return credit[(key * 0x9E3779B97F4A7C15ULL) >> 52];
+}
+
+void reset_delay_after_fork() {
+	for (std::atomic<uint64_t> &slot : credit) slot = 0;
+	global_delay_ns = 0;
+	paused_ns = 0;
+	local_delay_ns = 0;
+	profiled_local_delay = &local_delay_ns;
+}
+
+void add_delay(size_t new_hits, bool on_application_thread) {
+	if (!inject_delays) return;
+	if (new_hits > 0) {
+		uint64_t delay = new_hits * delay_length_ns;
+		// Credit the profiled thread first, so it never sees a debt for its own hits
+		*profiled_local_delay += delay;
+		global_delay_ns += delay;
+	}
+	if (on_application_thread) catch_up();
+}
+
+void catch_up() {
+	if (!inject_delays) return;
+	uint64_t global = global_delay_ns.load();
+	uint64_t local = local_delay_ns.load();
+	if (global <= local) return;
+
+	pause_for(global - local);
+	local_delay_ns += global - local;
+}
+
+uint64_t pre_block() {
+	// A thread about to block holds none of our locks, so it can pick up code mapped since the
+	// last drain, unless this is one of the application's signal handlers
+	if (!signal_depth) p.refresh_modules_if_changed();
+	if (!inject_delays) return 0;
+	catch_up();
+	return global_delay_ns.load();
+}
+
+void post_block(uint64_t global_at_block) {
+	if (!inject_delays) return;
+	local_delay_ns += global_delay_ns.load() - global_at_block;
+}
+
+void wake(const void* object) {
+	if (!inject_delays) return;
+	catch_up();
+
+	std::atomic<uint64_t> &slot = credit_slot(object);
+	uint64_t local = local_delay_ns.load();
+	uint64_t current = slot.load();
+	while (current < local && !slot.compare_exchange_weak(current, local));
+}
+
+void post_wake(const void* object) {
+	if (!inject_delays) return;
+	uint64_t handed = credit_slot(object).load();
+	if (handed > local_delay_ns.load()) local_delay_ns = handed;
+}
+
+void track_eventfd(int fd) {
+	if (fd >= 0 && fd < MAX_EVENTFDS) eventfds[fd] = true;
+}
+
+void untrack_eventfd(int fd) {
+	if (fd >= 0 && fd < MAX_EVENTFDS) eventfds[fd] = false;
+}
+
+bool is_eventfd(int fd) {
+	return fd >= 0 && fd < MAX_EVENTFDS && eventfds[fd].load(std::memory_order_relaxed);
+}
+
+uint64_t get_local_delay() {
+	return local_delay_ns.load();
+}
+
+void set_local_delay(uint64_t local_ns) {
+	local_delay_ns = local_ns;
+}
+
+uint64_t get_global_delay() {
+	return global_delay_ns.load();
+}
+
+uint64_t get_paused_ns() {
+	return paused_ns.load();
+}
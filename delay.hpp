@@ -0,0 +1,61 @@
+#ifndef DELAY_HPP
+#define DELAY_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/*
+	Coz-style delay injection. Every hit on the profiled line adds delay_length_ns to a global
+	delay count, and to the local count of the thread that executed it. Every other thread pays
+	the difference by pausing at well-defined points (sample processing, blocking calls, mutex
+	unlocks), so the rest of the program is slowed down by exactly what speeding up the line
+	would have saved. The runtime minus the global delay is then the virtual runtime, as before.
+
+	Only active when DCUZ_INJECT_DELAYS is set. Otherwise all of these are no-ops, except for the
+	module refresh in pre_block.
+*/
+extern std::atomic<bool> inject_delays;
+
+// Calibrates the pause and registers the calling thread as the profiled one
+bool init_delay_injection();
+
+// Called in a forked child. Only the forking thread survives, and it starts with no debt.
+void reset_delay_after_fork();
+
+// Profiler hit callback. Adds the delay for `new_hits`, then pays this thread's debt if it is an
+// application thread.
+void add_delay(size_t new_hits, bool on_application_thread);
+
+// Pauses this thread until it has paid every delay added so far
+void catch_up();
+
+// Around a blocking call. Debts are paid before blocking, and delays added while blocked are
+// skipped, since the thread wasn't running to be slowed down by them. pre_block also refreshes
+// the module map if code was mapped in, whether or not delays are injected.
+uint64_t pre_block();
+void post_block(uint64_t global_at_block);
+
+// Around a handoff between threads, keyed by the object used to wake (a mutex, condition variable
+// or eventfd). The waker pays its debt and leaves its count as credit, and the woken thread takes
+// that credit, since it can't have run ahead of the thread that woke it. Delays added after the
+// handoff are still owed.
+void wake(const void* object);
+void post_wake(const void* object);
+
+// Key for handoffs through an eventfd
+inline const void* eventfd_key(int fd) { return reinterpret_cast<const void*>(~uintptr_t(fd)); }
+
+// Whether `fd` was created by eventfd, and so is a handoff between threads
+void track_eventfd(int fd);
+void untrack_eventfd(int fd);
+bool is_eventfd(int fd);
+
+// The local count a new thread starts with, so it doesn't owe delays from before it existed
+uint64_t get_local_delay();
+void set_local_delay(uint64_t local_ns);
+
+uint64_t get_global_delay();
+uint64_t get_paused_ns();
+
+#endif //DELAY_HPP
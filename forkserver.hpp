@@ -0,0 +1,34 @@
+#ifndef FORKSERVER_HPP
+#define FORKSERVER_HPP
+
+#include <atomic>
+
+/*
+	Warm-start experiments. With DCUZ_FORKSERVER=<file> set, the process runs normally up to a
+	warm point, then forks one child per line of the file, one at a time. Each child starts from
+	the warmed-up state with fresh counters and its own line and speedup, and writes its own
+	results. The parent only waits, and exits once every experiment has finished.
+
+	Only memory is copied. Sockets are shared with the parent and its peers, so each child picks up
+	connections where the previous child left them, not as they were at the warm point.
+*/
+
+/**
+	Marks the warm point. An application can call this directly, e.g. once its cluster has elected
+	a leader, declaring it weak so it still links without the preload:
+
+		extern void dcuz_fork_point(void) __attribute__((weak));
+		if (dcuz_fork_point) dcuz_fork_point();
+
+	Only the first call in the original process does anything. It returns in each child, and never
+	in the parent, unless a tracked socket still holds input the application hasn't read: every
+	child would get a copy of it, but only the first could read on from there. The call then
+	returns without forking, and the fork point is taken at a later epoll_pwait once it's read.
+*/
+extern "C" void dcuz_fork_point();
+
+// Set by SIGUSR2. Forking from the handler could split the event loop mid-update, so the next
+// epoll_pwait takes the fork point instead.
+extern std::atomic<bool> fork_point_requested;
+
+#endif //FORKSERVER_HPP
@@ -18,9 +18,35 @@ def get_text_section_base_address(elffile):
         return text_section['sh_addr']
     return 0 # Default if .text section not found or other issue
 
+def line_ranges(sequence, end_address, module_name):
+    """
+    Turns the rows of one line program sequence into address ranges, merging consecutive rows
+    that belong to the same source line. `sequence` holds (address, file, line) tuples, with file
+    None for rows we couldn't attribute, and `end_address` is where the sequence ends.
+    Returns mapping dicts with the first address of each range and its size in bytes.
+    """
+    ranges = []
+    for i, (address, filename, line) in enumerate(sequence):
+        next_address = sequence[i + 1][0] if i + 1 < len(sequence) else end_address
+        if filename is None or next_address <= address:
+            continue
+        prev = ranges[-1] if ranges else None
+        if prev and (prev["file"], prev["line"]) == (filename, line) and prev["offset"] + prev["size"] == address:
+            prev["size"] = next_address - prev["offset"]
+        else:
+            ranges.append({
+                "module": module_name,
+                "file": filename,
+                "line": line,
+                "offset": address,
+                "size": next_address - address,
+            })
+    return ranges
+
 def generate_line_to_offset_mapping(filepath, output_filepath=None, module_name=None):
     """
-    Generates a mapping from source lines to instruction offsets for an ELF file.
+    Generates a mapping from source lines to instruction ranges for an ELF file. Each row is
+    `module,file,line,offset,size`, covering the `size` bytes of code starting at `offset`.
 
     :param filepath: Path to the ELF binary or shared library.
     :param output_filepath: Optional path to save the mapping. If None, prints to stdout.
@@ -64,11 +90,15 @@ def generate_line_to_offset_mapping(filepath, output_filepath=None, module_name=
                 lp_header = lineprog.header # This is the LineProgramHeader object
                 file_entries = lp_header["file_entry"]
 
-                # Decode the line program entries
+                # Decode the line program entries. Each row covers the addresses up to the next
+                # row in its sequence, so we collect whole sequences before emitting ranges.
+                sequence = []
                 for entry in lineprog.get_entries():
-                    # We're interested in entries that are not end_sequence and have a valid line number
-                    # An entry associates an address with a source line.
-                    if entry.state is None or entry.state.end_sequence:
+                    if entry.state is None:
+                        continue
+                    if entry.state.end_sequence:
+                        mappings.extend(line_ranges(sequence, entry.state.address, module_name))
+                        sequence = []
                         continue
 
                     # entry.state.file is an index into the CU's file table.
@@ -79,6 +109,7 @@ def generate_line_to_offset_mapping(filepath, output_filepath=None, module_name=
                         # This can happen for compiler-generated code or prologue/epilogue
                         # without explicit source lines.
                         print(f"Skipping entry with file_index {file_index} at address 0x{entry.state.address:x}", file=sys.stderr)
+                        sequence.append((entry.state.address, None, None))
                         continue
 
                     # File and directory indices are 1-indexed in DWARF version < 5,
@@ -86,6 +117,7 @@ def generate_line_to_offset_mapping(filepath, output_filepath=None, module_name=
                     if lp_header.version < 5:
                         file_index -= 1
                         if file_index == -1:
+                            sequence.append((entry.state.address, None, None))
                             continue
                         file_entry = file_entries[file_index]
                         dir_index = file_entry["dir_index"] - 1
@@ -96,23 +128,10 @@ def generate_line_to_offset_mapping(filepath, output_filepath=None, module_name=
                         dir_index = file_entry["dir_index"]
                         filename = posixpath.join(lp_header["include_directory"][dir_index], file_entry.name).decode('utf-8', errors='replace')
 
-                    line_num = entry.state.line
-                    address_offset = entry.state.address # This is the VMA (Virtual Memory Address)
-
-                    # We only want lines that are not marked as "prologue end" or "epilogue begin"
-                    # and are actual statements (not basic blocks etc., though lineprog doesn't distinguish that finely)
-                    # is_stmt is a boolean indicating if the instruction is recommended as a statement boundary.
-                    if entry.state.is_stmt:
-                        # Ensure the address is within a reasonable range (e.g., .text section) if desired.
-                        # For simplicity, we'll take all addresses from the line program.
-                        # The 'address_offset' is usually the absolute VMA as linked in the ELF.
-                        # For PIE/shared libs, this is an offset from the load base.
-                        mappings.append({
-                            "module": module_name,
-                            "file": filename,
-                            "line": line_num,
-                            "offset": address_offset # This is the VMA, effectively an offset for PIE/shared
-                        })
+                    # entry.state.address is the VMA as linked in the ELF, which for PIE/shared
+                    # libs is an offset from the load base. Rows that aren't statement boundaries
+                    # still tell us which line the following instructions belong to, so keep them.
+                    sequence.append((entry.state.address, filename, entry.state.line))
 
     except FileNotFoundError:
         print(f"Error: File '{filepath}' not found.", file=sys.stderr)
@@ -121,11 +140,17 @@ def generate_line_to_offset_mapping(filepath, output_filepath=None, module_name=
         print(f"An error occurred while processing '{filepath}': {e}", file=sys.stderr)
         return
 
-    # Deduplicate and sort (optional, but makes output cleaner)
-    # A single source line can map to multiple instruction blocks, but we often just need one offset per line.
-    # However, for *random selection of an executable instruction*, more entries are better.
-    # For now, let's keep all direct mappings from line program entries.
-    # You might want to refine what constitutes a "unique mappable line" later.
+    # Line tables are split by sequence and CU, so merge any ranges of the same line that ended up
+    # adjacent. Each remaining row is one contiguous block of instructions for a line.
+    mappings.sort(key=lambda m: m["offset"])
+    merged = []
+    for m in mappings:
+        prev = merged[-1] if merged else None
+        if prev and (prev["file"], prev["line"]) == (m["file"], m["line"]) and prev["offset"] + prev["size"] == m["offset"]:
+            prev["size"] += m["size"]
+        else:
+            merged.append(dict(m))
+    mappings = merged
 
     # Output
     df = pd.DataFrame(mappings)
@@ -12,19 +12,35 @@
 #include <algorithm>
 #include <iostream>
 #include <link.h>
-#include <fstream>
 #include <unordered_map>
-
-#include "hook.hpp"
+#include <pthread.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <string>
+#include <vector>
+
+#include "delay.hpp"
+#include "forkserver.hpp"
+#include "metrics.hpp"
+#include "overhead.hpp"
 #include "profiler.hpp"
+#include "replay.hpp"
+#include "socket_hook.hpp"
+#include "time_hook.hpp"
 #include "utils/mempool.hpp"
+#include "utils/modulemap.hpp"
+#include "utils/results.hpp"
 #include "utils/time.hpp"
 
 typedef int(*execve_t)(const char *pathname, char *const argv[], char *const envp[]);
 typedef int (*main_fn_t)(int, char**, char**);
+typedef int(*sigaction_t)(int signum, const struct sigaction* act, struct sigaction* oldact);
+typedef void(*exit_t)(int status);
 
 execve_t real_execve = nullptr;
 main_fn_t real_main = nullptr;
+sigaction_t real_sigaction = nullptr;
+exit_t real_exit = nullptr;
 
 // Global data structures
 Profiler p;
@@ -33,7 +49,38 @@ Profiler p;
 size_t delay_length_ns = 0;
 
 // How much we've virtually delayed
-uint64_t delayed_ns = 0;
+std::atomic<uint64_t> delayed_ns(0);
+
+// When the profiled run started, reset in forked children
+time_ns start_time;
+
+// Set while the profiler is running and our results still need writing
+std::atomic<bool> profiling(false);
+
+// Everything about the run that is known up front, and where its results go
+ResultRecord result_record;
+char results_path[4096];
+
+// Where to dump sampled ips relative to their modules, if requested
+const char* ip_histogram_path = nullptr;
+
+// Where to dump per-connection packet histograms, if requested
+const char* histograms_path = nullptr;
+
+// Every loaded object, so the target can be found in libraries loaded after main and sampled ips
+// can be mapped back to their modules
+ModuleMap modules;
+const char* target_module = nullptr;
+uint64_t target_offset = 0;
+size_t target_size = 1;
+
+// Env vars that configure DCuz, so they survive execs that replace the environment
+static const char* const PROPAGATED_ENV[] = {
+	"LD_PRELOAD", "DCUZ_MODULE", "DCUZ_OFFSET", "DCUZ_SPEEDUP", "DCUZ_SIZE", "DCUZ_ATTRIBUTION", "DCUZ_CALLCHAIN_DEPTH", "DCUZ_COLLECTOR", "DCUZ_INJECT_DELAYS", "DCUZ_RESULTS", "DCUZ_METRICS_SOCKET",
+	"DCUZ_IP_HISTOGRAM", "DCUZ_VIRTUAL_TIME", "DCUZ_HISTOGRAMS", "DCUZ_RECORD",
+	"DCUZ_FORKSERVER", "DCUZ_FORKSERVER_DURATION_MS", "DCUZ_TRACK_PIPES", "DCUZ_COALESCE", "DCUZ_RUN_ID"
+};
+constexpr size_t N_PROPAGATED_ENV = sizeof(PROPAGATED_ENV) / sizeof(PROPAGATED_ENV[0]);
 
 bool reconstruct_envp(const char* env_name, char* envp, size_t envp_len) {
 	const char* env = getenv(env_name);
@@ -53,84 +100,407 @@ extern "C" int execve(const char *pathname, char *const argv[], char *const envp
 		real_execve = (execve_t) dlsym(RTLD_NEXT, "execve");
 	}
 
-	char* new_envp[256];
+	char* new_envp[1024];
 	size_t ncopied = 0;
-	char ld_preload_envp[256];
-	char dcuz_module_envp[256];
-	char dcuz_offset_envp[256];
-	char dcuz_speedup_envp[256];
+	char propagated_envp[N_PROPAGATED_ENV][256];
 
 	// Copy over necessary env vars
-	if (reconstruct_envp("LD_PRELOAD", ld_preload_envp, 256)) {
-		new_envp[ncopied] = ld_preload_envp;
-		ncopied++;
-	}
-	if (reconstruct_envp("DCUZ_MODULE", dcuz_module_envp, 256)) {
-		new_envp[ncopied] = dcuz_module_envp;
-		ncopied++;
-	}
-	if (reconstruct_envp("DCUZ_OFFSET", dcuz_offset_envp, 256)) {
-		new_envp[ncopied] = dcuz_offset_envp;
-		ncopied++;
+	for (size_t i = 0; i < N_PROPAGATED_ENV; i++) {
+		if (reconstruct_envp(PROPAGATED_ENV[i], propagated_envp[ncopied], 256)) {
+			new_envp[ncopied] = propagated_envp[ncopied];
+			ncopied++;
+		}
 	}
-	if (reconstruct_envp("DCUZ_SPEEDUP", dcuz_speedup_envp, 256)) {
-		new_envp[ncopied] = dcuz_speedup_envp;
-		ncopied++;
+
+	// Framed fds the new image inherits, so it keeps framing them
+	char tracked_envp[8192];
+	int prefix = snprintf(tracked_envp, sizeof(tracked_envp), "DCUZ_TRACKED_FDS=");
+	if (list_inherited_fds(tracked_envp + prefix, sizeof(tracked_envp) - prefix)) {
+		new_envp[ncopied++] = tracked_envp;
 	}
 
-	// Copy over other envp
-	for (int i = ncopied; i < 100; i++) {
+	// Copy over other envp, leaving room for its nullptr
+	constexpr size_t MAX_ENVP = sizeof(new_envp) / sizeof(new_envp[0]);
+	for (size_t i = ncopied; ; i++) {
+		if (i == MAX_ENVP) {
+			// At end but no nullptr seen, too many env vars
+			errno = E2BIG;
+			return -1;
+		}
 		new_envp[i] = envp[i - ncopied];
-
 		if (new_envp[i] == nullptr) break;
-		if (i == 99) return E2BIG; // At end but no nullptr seen, too many env vars
 	}
 
+	// Buffered writes don't survive the exec
+	drain_output();
 	return real_execve(pathname, argv, new_envp);
 }
 
-struct DlIterateData {
-	const char* target_lib_name;
-	uintptr_t base_address;
-	bool found;
+/*
+	Rebuilds the module map and points the profiler at wherever the target module is now loaded.
+	If it isn't loaded, nothing matches until a later dlopen brings it in.
+*/
+static bool refresh_modules() {
+	modules.refresh();
+	const Module* m = target_module ? modules.find_by_name(target_module) : nullptr;
+	if (m) {
+		p.set_profiled_range(m->base + target_offset, target_size);
+	} else {
+		p.set_profiled_range(0, 0);
+	}
+	return m != nullptr;
+}
+
+// Libraries can be loaded after main starts, which the profiler sees as the code being mapped in
+static void refresh_mapped_modules() {
+	if (profiling) refresh_modules();
+}
+
+/*
+	Runs in the parent before a fork. The child drops its copy of what is buffered, so send it now,
+	or the parent's peers wait on it for as long as the parent waits on the child.
+*/
+static void flush_before_fork() {
+	flush_output();
+}
+
+/*
+	Runs in the child after a fork. The child inherits the parent's counters and perf state, so
+	reset them and start measuring the child on its own. The fds table and memory pool are left
+	alone: fork already gave the child a private copy, so any queued packets are cloned.
+*/
+static void reset_after_fork() {
+	delayed_ns = 0;
+	reset_delay_after_fork();
+	reset_overhead_after_fork();
+	reset_connection_histograms();
+	reset_recording_after_fork();
+	reset_coalescing_after_fork();
+	start_time = now_ns();
+	if (!p.reinit_after_fork()) {
+		std::cerr << "Failed to reinitialize profiler in forked child " << getpid() << "." << std::endl;
+	}
+
+	// Threads don't survive fork, so the child needs its own metrics server
+	const char* metrics_socket = getenv("DCUZ_METRICS_SOCKET");
+	if (metrics_socket) start_metrics_server(metrics_socket);
+}
+
+/*
+	Stops the profiler and appends this process's result record. We can get here from main
+	returning, exit(), _exit() or a SIGINT/SIGTERM that would otherwise kill us, so this runs at
+	most once and sticks to async-signal-safe calls. `in_signal` is set when we may be in a signal
+	handler, where the profiler is only stopped, not torn down.
+*/
+static void finish_profiling(bool in_signal) {
+	// Coalesced writes the application made are still owed to its peers
+	drain_output(false);
+	if (!profiling.exchange(false)) return;
+
+	time_ns end = now_ns();
+	stop_metrics_server();
+
+	// Shut down the profiler. Tearing it down joins the collector thread and reports through
+	// std::cerr, neither of which a signal handler can do.
+	if (in_signal) {
+		p.stop_in_signal_handler();
+	} else {
+		p.stop();
+	}
+
+	long ns_passed = end - start_time;
+	delayed_ns += p.get_hit_counts() * delay_length_ns;
+
+	ResultRecord record = result_record;
+	record.pid = getpid();
+	record.hit_counts = p.get_hit_counts();
+	record.self_hits = p.get_self_hits();
+	record.inclusive_hits = p.get_inclusive_hits();
+	record.profile_counts = p.get_profile_counts();
+	record.delayed_ns = delayed_ns;
+	record.runtime_ns = ns_passed;
+	record.overhead_ns = get_overhead_ns();
+	record.overhead_spans = get_overhead_spans();
+	record.nthreads = 1;
+	record.threads[0] = { uint64_t(p.get_tid()), record.hit_counts, record.profile_counts };
+
+	if (!append_result(results_path, record)) {
+		const char msg[] = "Failed to append results to the DCUZ_RESULTS file\n";
+		write(STDERR_FILENO, msg, sizeof(msg) - 1);
+	}
+
+	IpHistogram* histogram = p.get_ip_histogram();
+	if (histogram && ip_histogram_path && !histogram->dump(ip_histogram_path)) {
+		const char msg[] = "Failed to dump the DCUZ_IP_HISTOGRAM file\n";
+		write(STDERR_FILENO, msg, sizeof(msg) - 1);
+	}
+
+	if (histograms_path && !dump_connection_histograms(histograms_path)) {
+		const char msg[] = "Failed to dump the DCUZ_HISTOGRAMS file\n";
+		write(STDERR_FILENO, msg, sizeof(msg) - 1);
+	}
+
+	if (!flush_recording()) {
+		const char msg[] = "Failed to write the end of the DCUZ_RECORD trace\n";
+		write(STDERR_FILENO, msg, sizeof(msg) - 1);
+	}
+}
+
+static void finish_profiling_at_exit() {
+	finish_profiling(false);
+}
+
+/*
+	Handler used in place of the default action for SIGINT and SIGTERM. Flushes our results, then
+	restores the default action and re-raises so the process still dies by the signal.
+*/
+static void flush_and_reraise(int signum) {
+	finish_profiling(true);
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = SIG_DFL;
+	real_sigaction(signum, &sa, nullptr);
+	raise(signum);
+}
+
+static bool is_flush_signal(int signum) {
+	return signum == SIGINT || signum == SIGTERM;
+}
+
+static void install_flush_handler(int signum) {
+	if (!real_sigaction) {
+		real_sigaction = (sigaction_t) dlsym(RTLD_NEXT, "sigaction");
+	}
+
+	struct sigaction current;
+	if (real_sigaction(signum, nullptr, &current) != 0) return;
+	if (!(current.sa_flags & SA_SIGINFO) && current.sa_handler == SIG_DFL) {
+		current.sa_handler = flush_and_reraise;
+		real_sigaction(signum, &current, nullptr);
+	}
+}
+
+// The application's handlers, which run_app_handler calls in their place
+static struct sigaction app_handlers[NSIG];
+
+// Counts the application's handler in signal_depth, so the hooks it calls know not to block or lock
+static void run_app_handler(int signum, siginfo_t* info, void* context) {
+	const struct sigaction &app = app_handlers[signum];
+	signal_depth++;
+	if (app.sa_flags & SA_SIGINFO) {
+		app.sa_sigaction(signum, info, context);
+	} else {
+		app.sa_handler(signum);
+	}
+	signal_depth--;
+}
+
+// sa_handler and sa_sigaction share storage, so this holds either way
+static bool is_app_handler(const struct sigaction* act) {
+	return act->sa_handler != SIG_DFL && act->sa_handler != SIG_IGN;
+}
+
+/*
+	Applications that handle SIGINT/SIGTERM themselves shut down through main or exit, so their
+	handlers are installed behind run_app_handler and otherwise untouched. When they ask for the
+	default action we keep our flushing handler in its place, and report it back to them as SIG_DFL.
+	Any of their handlers is reported back as itself.
+*/
+extern "C" int sigaction(int signum, const struct sigaction* act, struct sigaction* oldact) {
+	if (!real_sigaction) {
+		real_sigaction = (sigaction_t) dlsym(RTLD_NEXT, "sigaction");
+	}
+	if (signum <= 0 || signum >= NSIG) return real_sigaction(signum, act, oldact);
+
+	struct sigaction previous_app = app_handlers[signum];
+	struct sigaction ours;
+	const struct sigaction* installed = act;
+	if (act && is_app_handler(act)) {
+		app_handlers[signum] = *act;
+		ours = *act;
+		ours.sa_flags |= SA_SIGINFO;
+		ours.sa_sigaction = run_app_handler;
+		installed = &ours;
+	} else if (act && is_flush_signal(signum) && profiling && !(act->sa_flags & SA_SIGINFO) && act->sa_handler == SIG_DFL) {
+		ours = *act;
+		ours.sa_handler = flush_and_reraise;
+		installed = &ours;
+	}
+
+	int ret = real_sigaction(signum, installed, oldact);
+	if (ret != 0) {
+		app_handlers[signum] = previous_app;
+		return ret;
+	}
+
+	if (oldact && (oldact->sa_flags & SA_SIGINFO) && oldact->sa_sigaction == run_app_handler) {
+		*oldact = previous_app;
+	} else if (oldact && !(oldact->sa_flags & SA_SIGINFO) && oldact->sa_handler == flush_and_reraise) {
+		oldact->sa_handler = SIG_DFL;
+	}
+	return ret;
+}
+
+// glibc's signal() doesn't go through the exported sigaction, so route it through ours
+extern "C" sighandler_t signal(int signum, sighandler_t handler) {
+	struct sigaction act, oldact;
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = handler;
+	act.sa_flags = SA_RESTART;
+	sigemptyset(&act.sa_mask);
+	sigaddset(&act.sa_mask, signum);
+	if (sigaction(signum, &act, &oldact) != 0) return SIG_ERR;
+	return oldact.sa_handler;
+}
+
+extern "C" void _exit(int status) {
+	if (!real_exit) {
+		real_exit = (exit_t) dlsym(RTLD_NEXT, "_exit");
+	}
+	// Often called from a signal handler
+	finish_profiling(true);
+	real_exit(status);
+	__builtin_unreachable();
+}
+
+extern "C" void _Exit(int status) {
+	_exit(status);
+}
+
+// One line of the DCUZ_FORKSERVER file: module,offset,size,speedup with the offset in hex
+struct ForkExperiment {
+	std::string module;
+	uint64_t offset;
+	size_t size;
+	double speedup;
 };
+static std::vector<ForkExperiment> fork_experiments;
+// How long each child runs before it is sent SIGTERM, or 0 to let it finish on its own
+static time_ns fork_duration_ns = 0;
+static bool fork_point_taken = false;
+static bool fork_point_deferred = false;
+std::atomic<bool> fork_point_requested(false);
+
+static bool load_fork_experiments(const char* path) {
+	FILE* f = fopen(path, "r");
+	if (!f) {
+		std::cerr << "Failed to open DCUZ_FORKSERVER file " << path << ": " << strerror(errno) << std::endl;
+		return false;
+	}
 
-static int find_library_callback(struct dl_phdr_info *info, size_t size, void *data) {
-	DlIterateData* search_data = static_cast<DlIterateData*>(data);
+	char line[4096 + 128];
+	char module[4096];
+	unsigned long long offset;
+	size_t size;
+	double speedup;
+	bool ok = true;
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '\n' || line[0] == '#') continue;
+		if (sscanf(line, "%4095[^,],%llx,%zu,%lf", module, &offset, &size, &speedup) != 4) {
+			std::cerr << "Bad DCUZ_FORKSERVER line: " << line;
+			ok = false;
+			break;
+		}
+		fork_experiments.push_back({ module, offset, size ? size : 1, speedup });
+	}
+	fclose(f);
+	return ok && !fork_experiments.empty();
+}
+
+static void request_fork_point(int) {
+	fork_point_requested = true;
+}
 
-	char exe[1024];
-	const char* dl_name = info->dlpi_name;
-	if (!dl_name || dl_name[0] == '\0') {
-		int ret = readlink("/proc/self/exe", exe, sizeof(exe)-1);
-		if(ret == -1) {
-			std::cerr << "Couldn't read /proc/self/exe" << std::endl;
-			return 0;
+static void* end_experiment(void*) {
+	sigset_t all;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, nullptr);
+
+	sleep_for(fork_duration_ns);
+	kill(getpid(), SIGTERM);
+	return nullptr;
+}
+
+/*
+	Runs in a forked child, after reset_after_fork has cleared the counters: retargets the profiler
+	at the child's own line and restarts the clock.
+*/
+static void start_experiment(const ForkExperiment &e) {
+	target_module = e.module.c_str();
+	target_offset = e.offset;
+	target_size = e.size;
+	delay_length_ns = e.speedup * 10000;
+
+	memset(result_record.module, 0, RESULTS_MODULE_LEN);
+	strncpy(result_record.module, target_module, RESULTS_MODULE_LEN - 1);
+	result_record.offset = e.offset;
+	result_record.size = e.size;
+	result_record.speedup = e.speedup;
+
+	if (!refresh_modules()) {
+		std::cerr << "Module " << target_module << " is not loaded, experiment " << getpid() << " will see no hits." << std::endl;
+	}
+
+	if (fork_duration_ns) {
+		pthread_t thread;
+		if (pthread_create(&thread, nullptr, end_experiment, nullptr) == 0) {
+			pthread_detach(thread);
+		} else {
+			std::cerr << "Failed to time experiment " << getpid() << ", it runs until it exits." << std::endl;
+		}
+	}
+
+	start_time = now_ns();
+	profiling = true;
+}
+
+extern "C" void dcuz_fork_point() {
+	fork_point_requested = false;
+	if (fork_point_taken || fork_experiments.empty() || !profiling) return;
+
+	// Every child would get its own copy of input already taken off a socket, but only the first
+	// finds the rest of it still there to read, so the others would decode the stream out of step.
+	// Wait until the application has read it, trying again at the next epoll_pwait.
+	if (has_buffered_input()) {
+		if (!fork_point_deferred) {
+			std::cerr << "Fork point deferred until the application has read what tracked sockets hold." << std::endl;
 		}
-		exe[ret] = 0;
-		dl_name = exe;
+		fork_point_deferred = true;
+		fork_point_requested = true;
+		return;
 	}
+	fork_point_taken = true;
+
+	// The warm-up is not an experiment, so the parent never writes results
+	profiling = false;
 
-	if (dl_name && strstr(dl_name, search_data->target_lib_name)) {
-		search_data->base_address = info->dlpi_addr; // This is the base address
-		search_data->found = true;
-		return 1; // Stop iteration
+	for (const ForkExperiment &e : fork_experiments) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			start_experiment(e);
+			return;
+		}
+		if (pid == -1) {
+			std::cerr << "Fork server failed to fork: " << strerror(errno) << std::endl;
+			break;
+		}
+
+		int status;
+		while (waitpid(pid, &status, 0) == -1 && errno == EINTR);
 	}
-	return 0; // Continue iteration
+
+	// Leave without running the application's exit path, which still belongs to the warm state
+	_exit(0);
 }
 
 static int wrapped_main(int argc, char** argv, char** env) {
-	// Read loaded modules
-	bool found = false;
-	uint64_t ip = 0;
+	// Read the target line. Its module is looked up once the profiler is set up
 	char* module_name = getenv("DCUZ_MODULE");
 	char* module_offset = getenv("DCUZ_OFFSET");
 	if (module_name && module_offset) {
-		ip = std::stoi(module_offset, 0, 16);
-		DlIterateData search_data = { .target_lib_name = module_name };
-		dl_iterate_phdr(find_library_callback, &search_data);
-
-		found = search_data.found;
-		ip += search_data.base_address;
+		target_module = module_name;
+		target_offset = std::stoi(module_offset, 0, 16);
 	} else {
 		std::cerr << "DCUZ_MODULE or DCUZ_OFFSET not found, running without profiler." << std::endl;
 		return real_main(argc, argv, env);
@@ -143,27 +513,155 @@ static int wrapped_main(int argc, char** argv, char** env) {
 		delay_length_ns = std::stof(dcuz_speedup) * 10000;
 	}
 
-	if (!found) {
-		std::cerr << "Unable to find correct module and offset (" << module_name << ":" << module_offset << "), running without profiler." << std::endl;
-		return real_main(argc, argv, env);
+	// Mappings cover a whole block of a line's instructions, since samples rarely land on its first one
+	char* dcuz_size = getenv("DCUZ_SIZE");
+	if (dcuz_size) {
+		target_size = strtoull(dcuz_size, nullptr, 10);
+		if (target_size == 0) target_size = 1;
+	}
+
+	// By default only samples executing the line are delayed, not ones where it's just on the stack
+	Attribution attribution = Attribution::SELF;
+	char* dcuz_attribution = getenv("DCUZ_ATTRIBUTION");
+	if (dcuz_attribution && strcmp(dcuz_attribution, "inclusive") == 0) {
+		attribution = Attribution::INCLUSIVE;
+	} else if (dcuz_attribution && strcmp(dcuz_attribution, "self") != 0) {
+		std::cerr << "Unknown DCUZ_ATTRIBUTION " << dcuz_attribution << ", using self." << std::endl;
 	}
+	char* dcuz_callchain_depth = getenv("DCUZ_CALLCHAIN_DEPTH");
+	size_t callchain_depth = dcuz_callchain_depth ? strtoull(dcuz_callchain_depth, nullptr, 10) : Profiler::DEFAULT_CALLCHAIN_DEPTH;
+	p.set_attribution(attribution, callchain_depth);
+
+	// Time the hooks with the TSC instead of clock_gettime where we can. Falls back silently, the
+	// vDSO clock is just slower.
+	calibrate_clock();
 
-	if (!p.init(ip, 10000, 10, 1e6)) {
+	// Measure our own cost, so it can be told apart from the application's runtime
+	init_overhead();
+
+	// Drain samples on a background thread instead of a SIGPROF handler in the profiled thread, so
+	// its blocking calls are not interrupted
+	char* dcuz_collector = getenv("DCUZ_COLLECTOR");
+	if (dcuz_collector && strcmp(dcuz_collector, "0") != 0) p.enable_collector();
+
+	if (!p.init(0, 0, 10000, 10, 1e6)) {
 		std::cerr << "Failed to initialize profiler, running without it." << std::endl;
 		return real_main(argc, argv, env);
 	}
 
+	// Actually pause the other threads for each hit, instead of only accounting for it at exit
+	char* dcuz_inject_delays = getenv("DCUZ_INJECT_DELAYS");
+	if (dcuz_inject_delays && strcmp(dcuz_inject_delays, "0") != 0) {
+		if (init_delay_injection()) {
+			p.set_hit_callback(add_delay);
+		} else {
+			std::cerr << "Failed to set up delay injection, running without it." << std::endl;
+		}
+	}
+
+	ip_histogram_path = getenv("DCUZ_IP_HISTOGRAM");
+	if (ip_histogram_path) p.enable_ip_histogram(&modules);
+
+	histograms_path = getenv("DCUZ_HISTOGRAMS");
+	if (histograms_path) record_histograms = true;
+
+	if (!refresh_modules()) {
+		std::cerr << "Module " << module_name << " is not loaded yet, profiling it once it is dlopened." << std::endl;
+	}
+	p.set_modules_callback(refresh_mapped_modules);
+
 	if (!p.start()) {
 		std::cerr << "Failed to start profiler, running without it." << std::endl;
 		return real_main(argc, argv, env);
 	}
 
+	const char* metrics_socket = getenv("DCUZ_METRICS_SOCKET");
+	if (metrics_socket && !start_metrics_server(metrics_socket)) {
+		std::cerr << "Failed to start metrics server, running without it." << std::endl;
+	}
+
+	if (pthread_atfork(flush_before_fork, nullptr, reset_after_fork) != 0) {
+		std::cerr << "Failed to register fork handler, forked children will not be profiled." << std::endl;
+	}
+
+	// Fill in the run configuration now, so finishing only has to add the counters
+	memset(&result_record, 0, sizeof(result_record));
+	strncpy(result_record.module, module_name, RESULTS_MODULE_LEN - 1);
+	result_record.offset = strtoull(module_offset, nullptr, 16);
+	result_record.speedup = dcuz_speedup ? strtod(dcuz_speedup, nullptr) : 0;
+	result_record.size = target_size;
+	result_record.attribution = uint32_t(p.get_attribution());
+	result_record.callchain_depth = p.get_max_callchain_depth();
+	result_record.overhead_span_cost_ns = get_overhead_span_cost_ns();
+	const char* run_id = getenv("DCUZ_RUN_ID");
+	if (run_id) result_record.run_id = strtoull(run_id, nullptr, 10);
+
+	const char* results_env = getenv("DCUZ_RESULTS");
+	strncpy(results_path, results_env ? results_env : "dcuz_results.bin", sizeof(results_path) - 1);
+
+	install_flush_handler(SIGINT);
+	install_flush_handler(SIGTERM);
+	atexit(finish_profiling_at_exit);
+
+	// Show the application virtual time, so its timers stretch along with the delays
+	char* dcuz_virtual_time = getenv("DCUZ_VIRTUAL_TIME");
+	if (dcuz_virtual_time && strcmp(dcuz_virtual_time, "0") != 0) virtualize_time = true;
+
+	// Frame local IPC as well, so delay crosses pipes and socketpairs between profiled processes
+	char* dcuz_track_pipes = getenv("DCUZ_TRACK_PIPES");
+	if (dcuz_track_pipes && strcmp(dcuz_track_pipes, "0") != 0) track_pipes = true;
+
+	// Fds the image that exec'd us was framing. Unset, so an exec we don't see can't pass it on stale.
+	const char* tracked_fds = getenv("DCUZ_TRACKED_FDS");
+	if (tracked_fds) {
+		track_inherited_fds(tracked_fds);
+		unsetenv("DCUZ_TRACKED_FDS");
+	}
+
+	// Send small framed writes together, at most this many microseconds after the first
+	char* dcuz_coalesce = getenv("DCUZ_COALESCE");
+	if (dcuz_coalesce && atoi(dcuz_coalesce) > 0 && !start_coalescing(strtoull(dcuz_coalesce, nullptr, 10) * 1000)) {
+		std::cerr << "Failed to start coalescing, sending every write as it is made." << std::endl;
+	}
+
+	// Record the traffic from peers, or play a recording back in their place. Both start now so
+	// their clocks line up with the run's.
+	const char* record_path = getenv("DCUZ_RECORD");
+	if (record_path && !start_recording(record_path)) {
+		std::cerr << "Failed to start recording, running without it." << std::endl;
+	}
+	const char* replay_path = getenv("DCUZ_REPLAY");
+	if (replay_path) {
+		const char* port_shift = getenv("DCUZ_REPLAY_PORT_SHIFT");
+		if (!start_replay(replay_path, port_shift ? atoi(port_shift) : 0)) {
+			std::cerr << "Failed to start replay, running without it." << std::endl;
+		}
+	}
+	// The replay stands in for one node's peers, so the processes it starts mustn't replay too
+	unsetenv("DCUZ_REPLAY");
+	unsetenv("DCUZ_REPLAY_PORT_SHIFT");
+
+	// Fork the experiments from a warmed-up process instead of starting each one from scratch
+	const char* forkserver_path = getenv("DCUZ_FORKSERVER");
+	if (forkserver_path) {
+		const char* duration_ms = getenv("DCUZ_FORKSERVER_DURATION_MS");
+		if (duration_ms) fork_duration_ns = strtoull(duration_ms, nullptr, 10) * 1000000;
+		if (load_fork_experiments(forkserver_path)) {
+			struct sigaction act;
+			memset(&act, 0, sizeof(act));
+			act.sa_handler = request_fork_point;
+			act.sa_flags = SA_RESTART;
+			real_sigaction(SIGUSR2, &act, nullptr);
+		} else {
+			std::cerr << "No experiments to fork, running as a single experiment." << std::endl;
+			fork_experiments.clear();
+		}
+	}
+
 	// Run the real main function
-	timespec start;
-	clock_gettime(CLOCK_MONOTONIC, &start);
+	start_time = now_ns();
+	profiling = true;
 	int result = real_main(argc, argv, env);
-	timespec end;
-	clock_gettime(CLOCK_MONOTONIC, &end);
 
 	// Increment the end-to-end progress point just before shutdown
 	/*if(end_to_end) {
@@ -172,31 +670,7 @@ static int wrapped_main(int argc, char** argv, char** env) {
 		end_point->visit();
 	}*/
 
-	// Shut down the profiler
-	p.stop();
-
-	std::ofstream outf;
-	std::string filename = std::to_string(getpid()) + ".txt";
-
-	outf.open(filename);
-	if (outf.is_open()) {
-		long billion = 1000000000L;
-		long ns_passed = billion * (end.tv_sec - start.tv_sec) + (long)(end.tv_nsec) - (long)(start.tv_nsec);
-		delayed_ns += p.get_hit_counts() * delay_length_ns;
-
-		outf << module_name << std::endl;
-		outf << module_offset << std::endl;
-		outf << dcuz_speedup << std::endl;
-		outf << p.get_hit_counts() << std::endl;
-		outf << p.get_profile_counts() << std::endl;
-		outf << delayed_ns << std::endl;
-		outf << ns_passed << std::endl;
-		outf.close();
-	} else {
-		std::cerr << p.get_hit_counts() << std::endl;
-		std::cerr << p.get_profile_counts() << std::endl;
-	}
-
+	finish_profiling(false);
 	return result;
 }
 
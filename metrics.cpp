@@ -0,0 +1,146 @@
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include "delay.hpp"
+#include "metrics.hpp"
+#include "overhead.hpp"
+#include "profiler.hpp"
+#include "socket_hook.hpp"
+#include "utils/mempool.hpp"
+
+extern Profiler p;
+extern MemoryPool mp;
+extern size_t delay_length_ns;
+extern std::atomic<uint64_t> delayed_ns;
+
+static int listen_fd = -1;
+
+// The socket this process bound, so it can be removed again when we finish
+static char socket_path[sizeof(((struct sockaddr_un*)nullptr)->sun_path)];
+static pid_t socket_owner = -1;
+
+template<typename... Args>
+static void append_fmt(std::string &out, const char* fmt, Args... args) {
+	char buf[256];
+	int n = snprintf(buf, sizeof(buf), fmt, args...);
+	if (n > 0) out.append(buf, std::min<size_t>(n, sizeof(buf) - 1));
+}
+
+/**
+	Builds a JSON snapshot of the profiler state. Every value is read with a single atomic load,
+	so fields are individually consistent but the snapshot as a whole is not a single instant.
+*/
+static std::string build_snapshot() {
+	size_t hit_counts = p.get_hit_counts();
+
+	std::string out;
+	out.reserve(4096);
+	append_fmt(out, "{\"pid\":%d,\"hit_counts\":%zu,\"self_hits\":%zu,\"inclusive_hits\":%zu,",
+		getpid(), hit_counts, p.get_self_hits(), p.get_inclusive_hits());
+	append_fmt(out, "\"profile_counts\":%zu,\"lost_samples\":%zu,", p.get_profile_counts(), p.get_lost_samples());
+	append_fmt(out, "\"delayed_ns\":%llu,\"virtual_delay_ns\":%llu,",
+		(unsigned long long)delayed_ns.load(), (unsigned long long)(delayed_ns.load() + hit_counts * delay_length_ns));
+	append_fmt(out, "\"global_delay_ns\":%llu,\"paused_ns\":%llu,",
+		(unsigned long long)get_global_delay(), (unsigned long long)get_paused_ns());
+	append_fmt(out, "\"overhead_ns\":%llu,\"overhead_spans\":%llu,",
+		(unsigned long long)get_overhead_ns(), (unsigned long long)get_overhead_spans());
+	append_fmt(out, "\"pool_size\":%zu,\"pool_free\":%zu,\"fds\":[", mp.get_size(), mp.get_free());
+
+	bool first = true;
+	for (int fd = 0; fd < MAX_METRICS_FDS; fd++) {
+		FdMetrics &fm = fd_metrics[fd];
+		if (!fm.tracked.load(std::memory_order_relaxed)) continue;
+		append_fmt(out, "%s{\"fd\":%d,\"queue_depth\":%zu,\"packets\":%llu,\"held_ns\":%llu,\"credited_ns\":%llu}",
+			first ? "" : ",", fd, fm.queue_depth.load(std::memory_order_relaxed),
+			(unsigned long long)fm.packets.load(std::memory_order_relaxed),
+			(unsigned long long)fm.held_ns.load(std::memory_order_relaxed),
+			(unsigned long long)fm.credited_ns.load(std::memory_order_relaxed));
+		first = false;
+	}
+	out += "]}\n";
+	return out;
+}
+
+static void* serve_metrics(void*) {
+	// Leave signal handling to the application's threads
+	sigset_t all;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, nullptr);
+
+	while (true) {
+		// Use the unhooked calls so this connection is never framed
+		int fd = real_accept(listen_fd, nullptr, nullptr);
+		if (fd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			std::cerr << "Metrics server accept failed: " << strerror(errno) << std::endl;
+			return nullptr;
+		}
+
+		std::string snapshot = build_snapshot();
+		size_t nwritten = 0;
+		while (nwritten < snapshot.size()) {
+			ssize_t n = real_write(fd, snapshot.data() + nwritten, snapshot.size() - nwritten);
+			if (n <= 0) break;
+			nwritten += n;
+		}
+		real_close(fd);
+	}
+}
+
+bool start_metrics_server(const char* path_prefix) {
+	initialize_real_functions();
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	int len = snprintf(addr.sun_path, sizeof(addr.sun_path), "%s.%d", path_prefix, getpid());
+	if (len < 0 || len >= (int)sizeof(addr.sun_path)) {
+		std::cerr << "Metrics socket path is too long: " << path_prefix << std::endl;
+		return false;
+	}
+
+	// A forked child inherits the parent's listening fd, but needs its own socket
+	if (listen_fd != -1) real_close(listen_fd);
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listen_fd == -1) {
+		std::cerr << "Failed to create metrics socket: " << strerror(errno) << std::endl;
+		return false;
+	}
+	unlink(addr.sun_path);
+	if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(listen_fd, 8) != 0) {
+		std::cerr << "Failed to listen on metrics socket " << addr.sun_path << ": " << strerror(errno) << std::endl;
+		real_close(listen_fd);
+		listen_fd = -1;
+		return false;
+	}
+	memcpy(socket_path, addr.sun_path, sizeof(socket_path));
+	socket_owner = getpid();
+
+	pthread_t thread;
+	if (pthread_create(&thread, nullptr, serve_metrics, nullptr) != 0) {
+		std::cerr << "Failed to start metrics thread" << std::endl;
+		stop_metrics_server();
+		real_close(listen_fd);
+		listen_fd = -1;
+		return false;
+	}
+	pthread_detach(thread);
+	return true;
+}
+
+void stop_metrics_server() {
+	// A child that couldn't start its own server must leave its parent's socket alone
+	if (socket_owner != getpid()) return;
+	socket_owner = -1;
+	unlink(socket_path);
+}
@@ -0,0 +1,15 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+/**
+    Starts a background thread serving a JSON snapshot of the profiler state on the Unix socket
+    `<path_prefix>.<pid>`. Every connection gets one snapshot and is then closed, e.g.
+
+        socat - UNIX-CONNECT:/tmp/dcuz.sock.1234
+*/
+bool start_metrics_server(const char* path_prefix);
+
+// Removes this process's metrics socket. Async-signal-safe, so it can run as we exit.
+void stop_metrics_server();
+
+#endif //METRICS_HPP
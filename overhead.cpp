@@ -0,0 +1,109 @@
+#include <atomic>
+#include <cstdint>
+#include <pthread.h>
+
+#include "overhead.hpp"
+#include "utils/time.hpp"
+
+/*
+	Each thread sums its spans into counters of its own, on their own cache line, so timing a hook
+	doesn't make every thread contend for one. Readers add up every thread's. A thread that exits
+	hands its counters on to the next new thread, which keeps adding to them.
+*/
+struct alignas(64) ThreadOverhead {
+	// Spans are summed in ticks, and converted once they are read
+	std::atomic<uint64_t> ticks{0};
+	std::atomic<uint64_t> spans{0};
+	std::atomic<bool> in_use{true};
+	ThreadOverhead* next = nullptr;
+};
+
+static std::atomic<ThreadOverhead*> all_overhead(nullptr);
+static thread_local ThreadOverhead* local_overhead __attribute__((tls_model("initial-exec"))) = nullptr;
+static pthread_key_t release_key;
+static pthread_once_t release_key_once = PTHREAD_ONCE_INIT;
+
+static uint64_t span_cost_ticks = 0;
+
+static void release_counters(void* counters) {
+	static_cast<ThreadOverhead*>(counters)->in_use.store(false, std::memory_order_release);
+}
+
+static void create_release_key() {
+	pthread_key_create(&release_key, release_counters);
+}
+
+static ThreadOverhead* claim_counters() {
+	pthread_once(&release_key_once, create_release_key);
+
+	ThreadOverhead* counters = nullptr;
+	for (ThreadOverhead* t = all_overhead.load(std::memory_order_acquire); t && !counters; t = t->next) {
+		bool in_use = false;
+		if (t->in_use.compare_exchange_strong(in_use, true)) counters = t;
+	}
+	if (!counters) {
+		counters = new ThreadOverhead();
+		counters->next = all_overhead.load();
+		while (!all_overhead.compare_exchange_weak(counters->next, counters));
+	}
+	pthread_setspecific(release_key, counters);
+	return counters;
+}
+
+// Only the owning thread writes its counters, so they don't need a locked add
+static void add(std::atomic<uint64_t> &counter, uint64_t value) {
+	counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+void init_overhead() {
+	// Time empty spans from the outside. Whatever the spans didn't see of that is the cost of
+	// timing them, which every span will add on top of what it measured.
+	constexpr uint64_t ROUNDS = 10000;
+	span_cost_ticks = 0;
+	overhead_end(overhead_begin());
+	uint64_t inside_before = local_overhead->ticks.load();
+	uint64_t start = now_ticks();
+	for (uint64_t i = 0; i < ROUNDS; i++) overhead_end(overhead_begin());
+	uint64_t outside = now_ticks() - start;
+	uint64_t inside = local_overhead->ticks.load() - inside_before;
+	span_cost_ticks = outside > inside ? (outside - inside) / ROUNDS : 0;
+
+	reset_overhead_after_fork();
+}
+
+void reset_overhead_after_fork() {
+	// Only the forking thread made it into a child, so every other thread's counters are free
+	for (ThreadOverhead* t = all_overhead.load(); t; t = t->next) {
+		t->ticks = 0;
+		t->spans = 0;
+		if (t != local_overhead) t->in_use = false;
+	}
+}
+
+uint64_t overhead_begin() {
+	return now_ticks();
+}
+
+void overhead_end(uint64_t start) {
+	uint64_t ticks = now_ticks() - start + span_cost_ticks;
+	ThreadOverhead* counters = local_overhead;
+	if (!counters) counters = local_overhead = claim_counters();
+	add(counters->ticks, ticks);
+	add(counters->spans, 1);
+}
+
+uint64_t get_overhead_ns() {
+	uint64_t ticks = 0;
+	for (ThreadOverhead* t = all_overhead.load(std::memory_order_acquire); t; t = t->next) ticks += t->ticks.load(std::memory_order_relaxed);
+	return ticks_to_ns(ticks);
+}
+
+uint64_t get_overhead_spans() {
+	uint64_t spans = 0;
+	for (ThreadOverhead* t = all_overhead.load(std::memory_order_acquire); t; t = t->next) spans += t->spans.load(std::memory_order_relaxed);
+	return spans;
+}
+
+uint64_t get_overhead_span_cost_ns() {
+	return ticks_to_ns(span_cost_ticks);
+}
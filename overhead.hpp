@@ -0,0 +1,33 @@
+#ifndef OVERHEAD_HPP
+#define OVERHEAD_HPP
+
+#include <cstdint>
+
+/*
+	Time the application spends in our own code rather than its own: framing and parsing packets
+	in the socket hooks, and draining samples in the SIGPROF handler. Each hook brackets the work
+	it adds with overhead_begin/overhead_end, leaving out anything the application would have done
+	anyway (the real read, write or epoll_pwait) and any time spent blocked or paused for a delay.
+
+	Spans are timed in the ticks of utils/time.hpp, which are the TSC's once calibrate_clock() has
+	found one, so timing a hook costs a few nanoseconds. What that timing itself costs is measured
+	at startup and added to every span.
+*/
+
+// Measures the cost of timing a span. Call after calibrate_clock(), since it changes the ticks
+void init_overhead();
+
+// Called in a forked child, which starts measuring from zero
+void reset_overhead_after_fork();
+
+// Around code that only runs because of us. Returns the start of the span.
+uint64_t overhead_begin();
+void overhead_end(uint64_t start);
+
+// Total over every thread, so on a multithreaded process it can exceed the wall clock time
+uint64_t get_overhead_ns();
+uint64_t get_overhead_spans();
+// Calibrated cost of timing one span, already included in get_overhead_ns
+uint64_t get_overhead_span_cost_ns();
+
+#endif //OVERHEAD_HPP
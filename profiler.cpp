@@ -3,6 +3,8 @@
 #include <sys/syscall.h>         /* Definition of SYS_* constants */
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <poll.h>
 #include <signal.h>
 #include <unistd.h>
 #include <time.h>
@@ -11,7 +13,9 @@
 #include <cstring>
 #include <cstdint>
 #include <dlfcn.h>
+#include <algorithm>
 
+#include "overhead.hpp"
 #include "profiler.hpp"
 
 extern Profiler p;
@@ -20,7 +24,7 @@ void sigaction_process_samples(int signum, siginfo_t* info, void* ctx) {
 }
 
 // Largely copied from Coz
-bool Profiler::init(uint64_t profiled_ip, size_t sample_period, size_t batch_size, size_t timer_period) {
+bool Profiler::init(uint64_t profiled_ip, size_t profiled_size, size_t sample_period, size_t batch_size, size_t timer_period) {
     struct perf_event_attr pe;
     memset(&pe, 0, sizeof(struct perf_event_attr));
     pe.size = sizeof(struct perf_event_attr);
@@ -29,11 +33,14 @@ bool Profiler::init(uint64_t profiled_ip, size_t sample_period, size_t batch_siz
     pe.type = PERF_TYPE_SOFTWARE;
     pe.config = PERF_COUNT_SW_TASK_CLOCK;
     pe.sample_type = PERF_SAMPLE_IP | PERF_SAMPLE_CALLCHAIN;
+    pe.sample_max_stack = max_callchain_depth;
     pe.sample_period = sample_period;
     pe.wakeup_events = batch_size; // This is ignored on linux 3.13 (why?)
     pe.exclude_idle = 1;
     pe.exclude_kernel = 1;
     pe.disabled = 1;
+    // Report code this thread maps in, e.g. a dlopened library, so the module map can follow it
+    pe.mmap = 1;
 
     // Init profiler
     perf_fd = syscall(SYS_perf_event_open, &pe, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
@@ -50,18 +57,26 @@ bool Profiler::init(uint64_t profiled_ip, size_t sample_period, size_t batch_siz
     }
     ring_buffer = reinterpret_cast<struct perf_event_mmap_page*>(rb);
 
+    tid = gettid();
+    set_profiled_range(profiled_ip, profiled_size);
+    this->sample_period = sample_period;
+    this->batch_size = batch_size;
+    timer_delay_ns = timer_period; //sample_period * batch_size;
+
+    // The collector thread is woken by the perf event itself, so needs no timer or signal
+    if (use_collector) return true;
+
     // Set up timer
     struct sigevent ev;
     memset(&ev, 0, sizeof(ev));
     ev.sigev_signo = SIGPROF;
     ev.sigev_notify = SIGEV_THREAD_ID;
-    ev._sigev_un._tid = gettid();
+    ev._sigev_un._tid = tid;
 
     if (timer_create(CLOCK_THREAD_CPUTIME_ID, &ev, &timer) != 0) {
         std::cerr << "Failed to create timer!" << std::endl;
         return false;
     }
-    timer_delay_ns = timer_period; //sample_period * batch_size;
 
     // Set up sigaction
     struct sigaction sa;
@@ -73,16 +88,20 @@ bool Profiler::init(uint64_t profiled_ip, size_t sample_period, size_t batch_siz
         return false;
     }
 
-    this->profiled_ip = profiled_ip;
-
     return true;
 }
 
+void Profiler::set_attribution(Attribution attribution, size_t max_callchain_depth) {
+    this->attribution = attribution;
+    this->max_callchain_depth = std::min(max_callchain_depth, MAX_CALLCHAIN_DEPTH);
+}
+
 bool Profiler::start() {
     if(perf_fd == -1) {
         std::cerr << "Profiler is not initialized yet." << std::endl;
         return false;
     }
+    if (use_collector) return start_collector();
 
     // Start timer
     long ns = timer_delay_ns % 1000000000;
@@ -106,6 +125,7 @@ bool Profiler::start() {
         timer_delete(timer);
         return false;
     }
+    running = true;
     return true;
 }
 
@@ -114,7 +134,13 @@ bool Profiler::stop() {
         std::cerr << "Profiler is not initialized yet." << std::endl;
         return false;
     }
-    if (timer_delete(timer) != 0) {
+    if (use_collector) {
+        // eventfd_write doesn't go through our write hook, and is fine in a signal handler
+        eventfd_write(stop_fd, 1);
+        pthread_join(collector, nullptr);
+        close(stop_fd);
+        stop_fd = -1;
+    } else if (timer_delete(timer) != 0) {
         std::cerr << "Failed to stop timer" << std::endl;
         return false;
     }
@@ -122,11 +148,117 @@ bool Profiler::stop() {
         std::cerr << "Failed to stop perf event: " << strerror(errno) << std::endl;
         return false;
     }
+
+    // Samples since the last drain would otherwise be lost
+    process_samples();
     close(perf_fd);
     munmap(ring_buffer, RING_BUFFER_SIZE);
+    perf_fd = -1;
+    ring_buffer = nullptr;
+    running = false;
+    return true;
+}
+
+bool Profiler::stop_in_signal_handler() {
+    if (perf_fd == -1) return false;
+    if (use_collector) eventfd_write(stop_fd, 1);
+    if (ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0) == -1) {
+        const char msg[] = "Failed to stop perf event\n";
+        write(STDERR_FILENO, msg, sizeof(msg) - 1);
+        return false;
+    }
+
+    // Returns right away if the collector is in the middle of a drain, which counts its own samples
+    process_samples();
+    running = false;
+    return true;
+}
+
+bool Profiler::reinit_after_fork() {
+    if (perf_fd == -1) return true;
+
+    // The perf event counts the parent's thread, and neither POSIX timers nor the collector thread
+    // are inherited, so there is nothing to stop here. Only our copies of the fds and mapping need
+    // releasing.
+    bool was_running = running;
+    munmap(ring_buffer, RING_BUFFER_SIZE);
+    close(perf_fd);
+    if (stop_fd != -1) close(stop_fd);
+    stop_fd = -1;
+    ring_buffer = nullptr;
+    perf_fd = -1;
+    running = false;
+    processing = false;
+    hit_counts = 0;
+    self_hits = 0;
+    inclusive_hits = 0;
+    profile_counts = 0;
+    lost_samples = 0;
+    if (ip_histogram) ip_histogram->clear();
+
+    if (!init(profiled_ip, profiled_size, sample_period, batch_size, timer_delay_ns)) return false;
+    if (was_running) return start();
+    return true;
+}
+
+bool Profiler::start_collector() {
+    stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (stop_fd == -1) {
+        std::cerr << "Failed to create collector eventfd: " << strerror(errno) << std::endl;
+        return false;
+    }
+    if (ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0) == -1) {
+        std::cerr << "Failed to start perf event: " << strerror(errno) << std::endl;
+        close(stop_fd);
+        stop_fd = -1;
+        return false;
+    }
+    if (pthread_create(&collector, nullptr, collector_main, this) != 0) {
+        std::cerr << "Failed to start collector thread" << std::endl;
+        ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+        close(stop_fd);
+        stop_fd = -1;
+        return false;
+    }
+    running = true;
     return true;
 }
 
+/*
+    Waits for the perf event to signal that batch_size samples are ready, then drains them. Uses
+    poll rather than epoll_pwait, which the socket hook interposes.
+*/
+void* Profiler::collector_main(void* arg) {
+    Profiler* profiler = static_cast<Profiler*>(arg);
+
+    // Leave signal handling to the application's threads
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, nullptr);
+
+    struct pollfd fds[2] = {
+        { profiler->perf_fd, POLLIN, 0 },
+        { profiler->stop_fd, POLLIN, 0 },
+    };
+    while (true) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) continue;
+            return nullptr;
+        }
+        if (fds[1].revents) return nullptr;
+        profiler->process_samples();
+        profiler->refresh_modules_if_changed();
+    }
+}
+
+void Profiler::set_profiled_range(uint64_t profiled_ip, size_t profiled_size) {
+    // Close the range before moving it, so a concurrent reader that sees the new size also sees
+    // the new ip
+    this->profiled_size = 0;
+    this->profiled_ip = profiled_ip;
+    this->profiled_size = profiled_size;
+}
+
 // Copies from ring_buffer. Assumes the data is actually available.
 void Profiler::copy_from_ring_buffer(size_t index, void* buf, size_t len) {
     uintptr_t base = reinterpret_cast<uintptr_t>(ring_buffer) + RING_BUFFER_HEADER_SIZE;
@@ -146,49 +278,100 @@ void Profiler::copy_from_ring_buffer(size_t index, void* buf, size_t len) {
     }
 }
 
+/**
+    Scans the callchain of a sample record for a caller frame in the profiled range. The chain
+    has PERF_CONTEXT_* markers mixed in with the ips, and its first real entry is the sampled ip
+    itself. The rest are return addresses, which point just past the call, so we match on the
+    byte before them to stay inside the calling line.
+*/
+template<typename Matcher>
+bool Profiler::callchain_contains(const char* record, Matcher is_profiled) {
+    uint64_t nr;
+    memcpy(&nr, record + sizeof(uint64_t), sizeof(uint64_t));
+    nr = std::min<uint64_t>(nr, MAX_CALLCHAIN_DEPTH);
+
+    size_t frames = 0;
+    for (size_t i = 0; i < nr && frames <= max_callchain_depth; i++) {
+        uint64_t ip;
+        memcpy(&ip, record + (i+2) * sizeof(uint64_t), sizeof(uint64_t));
+        if (ip >= PERF_CONTEXT_MAX) continue;
+        if (frames++ == 0) continue;
+        if (is_profiled(ip - 1)) return true;
+    }
+    return false;
+}
+
 void Profiler::process_samples() {
-    if (processing) return;
-    processing = true;
+    if (processing.exchange(true)) return;
+    // The collector thread runs beside the application, so only a drain in its own thread costs it
+    uint64_t overhead_start = use_collector ? 0 : overhead_begin();
 
-    // Read ring_buffer head for index and tail
+    size_t range_size = profiled_size;
+    uint64_t range_start = profiled_ip;
+    auto is_profiled = [=](uint64_t ip) { return ip - range_start < range_size; };
+
+    // Read ring_buffer head for index and tail. Runs in a signal handler, so no error reporting.
     if (!ring_buffer) {
-        std::cerr << "Trying to process samples before ring buffer is initialized!" << std::endl;
+        processing = false;
+        if (!use_collector) overhead_end(overhead_start);
         return;
     }
     struct perf_event_mmap_page *ring_buf_info = reinterpret_cast<struct perf_event_mmap_page*>(ring_buffer);
     size_t head = ring_buf_info->data_head;
     size_t tail = ring_buf_info->data_tail;
+    // The collector may run on another CPU than the one writing samples
+    std::atomic_thread_fence(std::memory_order_acquire);
 
     // Loop from index to head
+    size_t new_hits = 0;
     struct perf_event_header hdr;
     char record[4096];
     while(tail + sizeof(hdr) < head) {
         // Copy in packet
         copy_from_ring_buffer(tail, &hdr, sizeof(hdr));
-        copy_from_ring_buffer(tail + sizeof(hdr), record, hdr.size - sizeof(hdr));
+        copy_from_ring_buffer(tail + sizeof(hdr), record, std::min(hdr.size - sizeof(hdr), sizeof(record)));
         tail += hdr.size;
 
-        // Process ip and callstack
-        // An instruction pointer should only be in at most one at a time, so we can short circuit if we find a match.
+        // The kernel reports samples it had to drop when the ring buffer was full
+        if (hdr.type == PERF_RECORD_LOST) {
+            uint64_t lost;
+            memcpy(&lost, record + sizeof(uint64_t), sizeof(uint64_t));
+            lost_samples += lost;
+            continue;
+        }
+        // The map can't be rebuilt in a signal handler, so only note that it is out of date
+        if (hdr.type == PERF_RECORD_MMAP) {
+            modules_changed = true;
+            continue;
+        }
+        if (hdr.type != PERF_RECORD_SAMPLE) continue;
+
+        // Process ip and callstack. A sample that executes the line is also on the stack, so self
+        // hits count as inclusive hits too.
         uint64_t ip;
         memcpy(&ip, record, sizeof(uint64_t));
-        if (ip == profiled_ip) {
+        if (ip_histogram) ip_histogram->add(ip);
+        bool self = is_profiled(ip);
+        bool inclusive = self || callchain_contains(record, is_profiled);
+        if (self) self_hits++;
+        if (inclusive) inclusive_hits++;
+        if (attribution == Attribution::SELF ? self : inclusive) {
             hit_counts++;
-        } else {
-            uint64_t nr;
-            memcpy(&nr, record + sizeof(uint64_t), sizeof(uint64_t));
-            for (size_t i = 0; i < nr; i++) {
-                memcpy(&ip, record + (i+2) * sizeof(uint64_t), sizeof(uint64_t));
-                if (ip == profiled_ip) {
-                    hit_counts++;
-                    break;
-                }
-            }
+            new_hits++;
         }
         profile_counts++;
     }
 
     // Notify ring buf of our read data
+    std::atomic_thread_fence(std::memory_order_release);
     ring_buf_info->data_tail = tail;
     processing = false;
+    if (!use_collector) overhead_end(overhead_start);
+
+    if (hit_callback) hit_callback(new_hits, !use_collector);
+}
+
+void Profiler::refresh_modules_if_changed() {
+    if (!modules_changed.load(std::memory_order_relaxed) || !modules_changed.exchange(false)) return;
+    if (modules_callback) modules_callback();
 }
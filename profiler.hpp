@@ -6,22 +6,90 @@
 #include <unistd.h>
 #include <cstdint>
 #include <signal.h>
+#include <pthread.h>
+#include <atomic>
+
+#include "utils/iphistogram.hpp"
+
+// Which samples count as hits on the profiled line, and so get virtually delayed
+enum class Attribution {
+    // The line is executing: the sampled ip is in it
+    SELF,
+    // The line is on the stack: the sampled ip or any caller frame is in it
+    INCLUSIVE,
+};
+
+// Called after every drain with the hits it found. The flag is false on the collector thread,
+// and true when draining in the SIGPROF handler of the profiled thread.
+typedef void(*HitCallback)(size_t new_hits, bool on_application_thread);
+
+// Called outside any signal handler after the profiled thread has mapped in new code, e.g. by
+// dlopen, so the profiled range can be looked up again
+typedef void(*ModulesCallback)();
 
 struct Profiler {
-    Profiler(): ring_buffer(nullptr), perf_fd(-1), timer_delay_ns(0), processing(false),
-        hit_counts(0), profile_counts(0) {}
+    Profiler(): ring_buffer(nullptr), perf_fd(-1), timer_delay_ns(0), use_collector(false), stop_fd(-1), hit_callback(nullptr),
+        modules_callback(nullptr), modules_changed(false), processing(false), running(false),
+        attribution(Attribution::SELF), max_callchain_depth(DEFAULT_CALLCHAIN_DEPTH), profiled_ip(0), profiled_size(0),
+        hit_counts(0), self_hits(0), inclusive_hits(0), profile_counts(0), lost_samples(0), ip_histogram(nullptr) {}
+
+    static constexpr size_t DEFAULT_CALLCHAIN_DEPTH = 64;
 
-    // Initializes the profiler, but does not start it.
-    bool init(uint64_t profiled_ip, size_t sample_period, size_t batch_size, size_t timer_period);
+    // Must be called before init, since the depth also bounds what the kernel records. Both self
+    // and inclusive hits are always counted, `attribution` picks which one get_hit_counts reports.
+    void set_attribution(Attribution attribution, size_t max_callchain_depth);
+
+    // Must be called before init. Drains samples on a background thread woken by the perf event
+    // every batch_size samples, instead of in a SIGPROF handler on the profiled thread.
+    void enable_collector() { use_collector = true; }
+
+    void set_hit_callback(HitCallback callback) { hit_callback = callback; }
+    void set_modules_callback(ModulesCallback callback) { modules_callback = callback; }
+
+    // Runs the modules callback if code was mapped in since the last call. Drains only note the
+    // mapping, since they may run in the SIGPROF handler, so this is called from the collector
+    // thread after a drain, and from the mutex, epoll and blocking hooks on application threads.
+    void refresh_modules_if_changed();
+
+    // Initializes the profiler, but does not start it. Samples hit the line when their ip, or any
+    // frame of their callchain, falls in [profiled_ip, profiled_ip + profiled_size).
+    bool init(uint64_t profiled_ip, size_t profiled_size, size_t sample_period, size_t batch_size, size_t timer_period);
     bool start();
     bool stop();
+    // Stops sampling from a signal handler, leaving the rest to process exit. The collector thread
+    // is told to stop but not joined, since it may be mid-drain while the handler runs.
+    bool stop_in_signal_handler();
+
+    // Called in a forked child. The perf event and timer belong to the parent's thread, so this
+    // drops the inherited state, resets the counters and re-opens everything for the child.
+    bool reinit_after_fork();
+
+    // Retargets the profiler, e.g. when the profiled module is loaded or unloaded. A size of 0
+    // matches nothing. Safe to call while running.
+    void set_profiled_range(uint64_t profiled_ip, size_t profiled_size);
 
     inline size_t get_hit_counts() { return hit_counts; }
+    inline size_t get_self_hits() { return self_hits; }
+    inline size_t get_inclusive_hits() { return inclusive_hits; }
+    inline Attribution get_attribution() { return attribution; }
+    inline size_t get_max_callchain_depth() { return max_callchain_depth; }
     inline size_t get_profile_counts() { return profile_counts; }
+    inline size_t get_lost_samples() { return lost_samples; }
+    inline pid_t get_tid() { return tid; }
 
     void process_samples();
 
+    // Also count every sampled ip, so a profiling run can rank which lines are worth experimenting on
+    void enable_ip_histogram(const ModuleMap* modules) { if (!ip_histogram) ip_histogram = new IpHistogram(modules); }
+    IpHistogram* get_ip_histogram() { return ip_histogram; }
+
 private:
+    bool start_collector();
+    static void* collector_main(void* arg);
+
+    template<typename Matcher>
+    bool callchain_contains(const char* record, Matcher is_profiled);
+
     // Copies from ring_buffer. Assumes the data is actually available.
     void copy_from_ring_buffer(size_t index, void* buf, size_t len);
 
@@ -30,16 +98,49 @@ private:
     static constexpr size_t RING_BUFFER_HEADER_SIZE = 0x1000;
     static constexpr size_t RING_BUFFER_DATA_SIZE = RING_BUFFER_DATA_PAGES * 0x1000;
     static constexpr size_t RING_BUFFER_SIZE = RING_BUFFER_DATA_SIZE + RING_BUFFER_HEADER_SIZE;
+
+    // Upper bound on the depth the kernel records. Records are copied into a 4KB buffer, which
+    // this keeps them within along with the context markers.
+    static constexpr size_t MAX_CALLCHAIN_DEPTH = 127;
     struct perf_event_mmap_page* ring_buffer;
     int perf_fd;
 
+    size_t sample_period;
+    size_t batch_size;
+
+    pid_t tid;
     timer_t timer;
     size_t timer_delay_ns;
-    bool processing;
 
-    uint64_t profiled_ip;
-    size_t hit_counts;
-    size_t profile_counts;
+    bool use_collector;
+    pthread_t collector;
+    // Written to wake the collector up when stopping
+    int stop_fd;
+
+    HitCallback hit_callback;
+    ModulesCallback modules_callback;
+    // Set by a drain that saw a PERF_RECORD_MMAP
+    std::atomic<bool> modules_changed;
+
+    // Guards against draining the ring from two places at once, e.g. stop() and the collector
+    std::atomic<bool> processing;
+    bool running;
+
+    Attribution attribution;
+    size_t max_callchain_depth;
+
+    // Atomic since a module refresh on another thread can move the target under the signal handler
+    std::atomic<uint64_t> profiled_ip;
+    std::atomic<size_t> profiled_size;
+
+    // Atomic so they can be read from outside the signal handler (e.g. the metrics thread)
+    std::atomic<size_t> hit_counts;
+    std::atomic<size_t> self_hits;
+    std::atomic<size_t> inclusive_hits;
+    std::atomic<size_t> profile_counts;
+    std::atomic<size_t> lost_samples;
+
+    IpHistogram* ip_histogram;
 };
 
 void sigaction_process_samples(int signum, siginfo_t* info, void* ctx);
@@ -0,0 +1,480 @@
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <unordered_map>
+#include <vector>
+
+#include "replay.hpp"
+#include "socket_hook.hpp"
+#include "utils/time.hpp"
+#include "utils/trace.hpp"
+
+/*
+	Recording. Reads are appended to an in-memory buffer under a spinlock and written out when it
+	fills, so a recorded read costs a copy rather than a syscall.
+*/
+static std::atomic<bool> recording(false);
+static char trace_prefix[4096];
+static int trace_fd = -1;
+static time_ns trace_start;
+
+static std::atomic_flag trace_lock = ATOMIC_FLAG_INIT;
+static char trace_buf[1 << 16];
+// Largest payload of one data event, leaving the buffer room for the event header
+constexpr ssize_t MAX_TRACE_CHUNK = 1 << 14;
+static size_t trace_len = 0;
+static uint32_t next_conn = 0;
+
+// What we know about each tracked fd's connection. conn is 0 until it has been written out.
+struct TracedConnection {
+	uint16_t type;
+	uint32_t conn;
+	time_ns time;
+	socklen_t addr_len;
+	sockaddr_storage addr;
+};
+static TracedConnection traced[MAX_METRICS_FDS];
+
+static bool write_all(int fd, const char* buf, size_t len) {
+	while (len > 0) {
+		ssize_t n = real_write(fd, buf, len);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return false;
+		buf += n;
+		len -= n;
+	}
+	return true;
+}
+
+// Caller holds trace_lock
+static bool flush_locked() {
+	bool ok = write_all(trace_fd, trace_buf, trace_len);
+	trace_len = 0;
+	return ok;
+}
+
+// Caller holds trace_lock
+static void append_event(uint32_t conn, uint16_t type, time_ns time, const void* payload, uint16_t len) {
+	TraceEvent event = { time, conn, type, len };
+	if (trace_len + sizeof(event) + len > sizeof(trace_buf) && !flush_locked()) {
+		const char msg[] = "Failed to write the DCUZ_RECORD trace\n";
+		real_write(STDERR_FILENO, msg, sizeof(msg) - 1);
+	}
+	memcpy(trace_buf + trace_len, &event, sizeof(event));
+	memcpy(trace_buf + trace_len + sizeof(event), payload, len);
+	trace_len += sizeof(event) + len;
+}
+
+bool start_recording(const char* path_prefix) {
+	initialize_real_functions();
+	if (path_prefix != trace_prefix) strncpy(trace_prefix, path_prefix, sizeof(trace_prefix) - 1);
+
+	char path[4096 + 16];
+	snprintf(path, sizeof(path), "%s.%d", trace_prefix, getpid());
+	trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (trace_fd == -1) {
+		std::cerr << "Failed to open trace " << path << ": " << strerror(errno) << std::endl;
+		return false;
+	}
+
+	TraceHeader header;
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	header.version = TRACE_VERSION;
+	header.header_size = sizeof(header);
+	if (!write_all(trace_fd, (const char*)&header, sizeof(header))) {
+		std::cerr << "Failed to write trace " << path << ": " << strerror(errno) << std::endl;
+		real_close(trace_fd);
+		trace_fd = -1;
+		return false;
+	}
+
+	trace_start = now_ns();
+	recording = true;
+	return true;
+}
+
+void reset_recording_after_fork() {
+	if (!recording) return;
+	recording = false;
+
+	// The parent writes out what it buffered. Its connections are the child's too, but have to be
+	// introduced again in the child's own trace.
+	trace_lock.clear();
+	trace_len = 0;
+	next_conn = 0;
+	for (TracedConnection &tc : traced) tc.conn = 0;
+	real_close(trace_fd);
+	start_recording(trace_prefix);
+}
+
+bool flush_recording() {
+	if (!recording) return true;
+	// A signal may have landed while this thread was appending, so don't wait for the lock
+	if (trace_lock.test_and_set(std::memory_order_acquire)) return false;
+	bool ok = flush_locked();
+	trace_lock.clear(std::memory_order_release);
+	return ok;
+}
+
+void record_connect(int fd, const struct sockaddr* addr, socklen_t addrlen) {
+	if (!recording || fd < 0 || fd >= MAX_METRICS_FDS) return;
+	TracedConnection &tc = traced[fd];
+	tc.type = TRACE_CONNECT;
+	tc.conn = 0;
+	tc.time = now_ns() - trace_start;
+	tc.addr_len = std::min<socklen_t>(addrlen, sizeof(tc.addr));
+	memcpy(&tc.addr, addr, tc.addr_len);
+}
+
+void record_accept(int fd) {
+	if (!recording || fd < 0 || fd >= MAX_METRICS_FDS) return;
+	TracedConnection &tc = traced[fd];
+	tc.type = TRACE_ACCEPT;
+	tc.conn = 0;
+	tc.time = now_ns() - trace_start;
+	// The accepted socket's own address is the one peers connect to, even on a wildcard listener
+	tc.addr_len = sizeof(tc.addr);
+	if (getsockname(fd, (sockaddr*)&tc.addr, &tc.addr_len) != 0) tc.type = 0;
+}
+
+void record_read(int fd, const char* buf, ssize_t n) {
+	if (!recording || n < 0 || fd < 0 || fd >= MAX_METRICS_FDS) return;
+	TracedConnection &tc = traced[fd];
+	if (tc.type == 0) return;
+	time_ns time = now_ns() - trace_start;
+
+	while (trace_lock.test_and_set(std::memory_order_acquire));
+	if (tc.conn == 0) {
+		tc.conn = ++next_conn;
+		append_event(tc.conn, tc.type, tc.time, &tc.addr, tc.addr_len);
+	}
+	if (n == 0) {
+		append_event(tc.conn, TRACE_EOF, time, nullptr, 0);
+	}
+	// Batched reads can exceed what one event holds, so they are split
+	while (n > 0) {
+		uint16_t len = std::min<ssize_t>(n, MAX_TRACE_CHUNK);
+		append_event(tc.conn, TRACE_DATA, time, buf, len);
+		buf += len;
+		n -= len;
+	}
+	trace_lock.clear(std::memory_order_release);
+}
+
+void record_close(int fd) {
+	if (fd < 0 || fd >= MAX_METRICS_FDS) return;
+	traced[fd].type = 0;
+}
+
+/*
+	Replay. One thread plays every peer, with non-blocking sockets so a node that stops reading
+	one connection can't hold up the others.
+*/
+struct ReplayConnection {
+	uint16_t type;
+	time_ns time;
+	socklen_t addr_len;
+	sockaddr_storage addr;
+	// Offsets of this connection's events in the trace
+	std::vector<size_t> events;
+	size_t next = 0;
+	// Bytes of the next event already written
+	size_t partial = 0;
+	int fd = -1;
+	bool blocked = false;
+	// When to try connecting again if the node wasn't listening yet
+	time_ns retry_time = 0;
+};
+
+// Stands in for a peer the node connects to. Connections are handed out in recorded order.
+struct ReplayListener {
+	sockaddr_storage addr;
+	socklen_t addr_len;
+	int fd;
+	std::vector<size_t> waiting;
+	size_t next_waiting = 0;
+};
+
+static std::vector<char> replay_trace;
+static std::vector<ReplayConnection> replay_connections;
+static std::vector<ReplayListener> replay_listeners;
+// Sockets the node opened beyond what was recorded, only drained
+static std::vector<int> replay_extra;
+static time_ns replay_start;
+
+static constexpr time_ns REPLAY_RETRY_NS = 10000000;
+
+static const TraceEvent* event_at(size_t offset) {
+	return (const TraceEvent*)(replay_trace.data() + offset);
+}
+
+static void shift_port(sockaddr_storage &addr, int port_shift) {
+	if (addr.ss_family == AF_INET) {
+		sockaddr_in* in = (sockaddr_in*)&addr;
+		in->sin_port = htons(ntohs(in->sin_port) + port_shift);
+	} else if (addr.ss_family == AF_INET6) {
+		sockaddr_in6* in6 = (sockaddr_in6*)&addr;
+		in6->sin6_port = htons(ntohs(in6->sin6_port) + port_shift);
+	}
+}
+
+static void set_nonblocking(int fd) {
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+static bool load_trace(const char* path, int port_shift) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		std::cerr << "Failed to open trace " << path << ": " << strerror(errno) << std::endl;
+		return false;
+	}
+	char buf[1 << 16];
+	ssize_t n;
+	while ((n = real_read(fd, buf, sizeof(buf))) > 0) replay_trace.insert(replay_trace.end(), buf, buf + n);
+	real_close(fd);
+
+	const TraceHeader* header = (const TraceHeader*)replay_trace.data();
+	if (replay_trace.size() < sizeof(TraceHeader) || memcmp(header->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0) {
+		std::cerr << "Not a DCuz trace: " << path << std::endl;
+		return false;
+	}
+	if (header->version != TRACE_VERSION) {
+		std::cerr << "Trace " << path << " is version " << header->version << ", expected " << TRACE_VERSION << std::endl;
+		return false;
+	}
+
+	std::unordered_map<uint32_t, size_t> by_conn;
+	size_t offset = header->header_size;
+	while (offset + sizeof(TraceEvent) <= replay_trace.size()) {
+		const TraceEvent* event = event_at(offset);
+		if (offset + sizeof(TraceEvent) + event->len > replay_trace.size()) break;
+
+		if (event->type == TRACE_CONNECT || event->type == TRACE_ACCEPT) {
+			ReplayConnection rc;
+			rc.type = event->type;
+			rc.time = event->time_ns;
+			rc.addr_len = std::min<socklen_t>(event->len, sizeof(rc.addr));
+			memset(&rc.addr, 0, sizeof(rc.addr));
+			memcpy(&rc.addr, event + 1, rc.addr_len);
+			shift_port(rc.addr, port_shift);
+			by_conn[event->conn] = replay_connections.size();
+			replay_connections.push_back(rc);
+		} else {
+			auto it = by_conn.find(event->conn);
+			if (it != by_conn.end()) replay_connections[it->second].events.push_back(offset);
+		}
+		offset += sizeof(TraceEvent) + event->len;
+	}
+
+	// The node connects in the order it did when recorded, so peers hand out connections that way
+	std::vector<size_t> order(replay_connections.size());
+	for (size_t i = 0; i < order.size(); i++) order[i] = i;
+	std::stable_sort(order.begin(), order.end(), [](size_t a, size_t b) {
+		return replay_connections[a].time < replay_connections[b].time;
+	});
+	for (size_t i : order) {
+		ReplayConnection &rc = replay_connections[i];
+		if (rc.type != TRACE_CONNECT) continue;
+
+		auto listener = std::find_if(replay_listeners.begin(), replay_listeners.end(), [&](const ReplayListener &l) {
+			return l.addr_len == rc.addr_len && memcmp(&l.addr, &rc.addr, rc.addr_len) == 0;
+		});
+		if (listener == replay_listeners.end()) {
+			ReplayListener l;
+			l.addr = rc.addr;
+			l.addr_len = rc.addr_len;
+			l.fd = -1;
+			replay_listeners.push_back(l);
+			listener = replay_listeners.end() - 1;
+		}
+		listener->waiting.push_back(i);
+	}
+	return true;
+}
+
+static bool open_listeners() {
+	for (ReplayListener &l : replay_listeners) {
+		l.fd = socket(l.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		int one = 1;
+		setsockopt(l.fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (l.fd == -1 || bind(l.fd, (sockaddr*)&l.addr, l.addr_len) != 0 || listen(l.fd, 64) != 0) {
+			std::cerr << "Failed to listen for replayed peer: " << strerror(errno) << std::endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+// Plays a peer that connected to the node. Returns false to try again later.
+static bool connect_to_node(ReplayConnection &rc) {
+	int fd = socket(rc.addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1) return false;
+	// Use the unhooked call so this connection is never framed
+	if (real_connect(fd, (sockaddr*)&rc.addr, rc.addr_len) != 0) {
+		real_close(fd);
+		return false;
+	}
+	set_nonblocking(fd);
+	rc.fd = fd;
+	return true;
+}
+
+// Writes whatever is due on `rc`, up to the first write that would block
+static void play_due(ReplayConnection &rc, time_ns now) {
+	while (rc.next < rc.events.size()) {
+		const TraceEvent* event = event_at(rc.events[rc.next]);
+		if (event->time_ns > now) return;
+
+		if (event->type == TRACE_EOF) {
+			real_shutdown(rc.fd, SHUT_WR);
+		} else {
+			const char* payload = (const char*)(event + 1);
+			while (rc.partial < event->len) {
+				ssize_t n = real_write(rc.fd, payload + rc.partial, event->len - rc.partial);
+				if (n < 0 && errno == EINTR) continue;
+				if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+					rc.blocked = true;
+					return;
+				}
+				if (n <= 0) {
+					// The node hung up, so the rest of the connection has nowhere to go
+					rc.next = rc.events.size();
+					return;
+				}
+				rc.partial += n;
+			}
+		}
+		rc.partial = 0;
+		rc.next++;
+	}
+}
+
+// Reads and discards what the node sent. Returns false once the node has closed its end.
+static bool drain(int fd) {
+	char buf[4096];
+	while (true) {
+		ssize_t n = real_read(fd, buf, sizeof(buf));
+		if (n > 0) continue;
+		if (n < 0 && errno == EINTR) continue;
+		return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+	}
+}
+
+static void accept_from_node(ReplayListener &l) {
+	while (true) {
+		int fd = real_accept4(l.fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd == -1) return;
+		if (l.next_waiting < l.waiting.size()) {
+			replay_connections[l.waiting[l.next_waiting++]].fd = fd;
+		} else {
+			replay_extra.push_back(fd);
+		}
+	}
+}
+
+static void* replay_peers(void*) {
+	// Leave signal handling to the application's threads
+	sigset_t all;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, nullptr);
+
+	std::vector<pollfd> pfds;
+	// What each pollfd is: a listener, a connection, or an extra socket
+	std::vector<std::pair<int, size_t>> owners;
+	while (true) {
+		time_ns now = now_ns() - replay_start;
+		time_ns next_due = UINT64_MAX;
+
+		for (ReplayConnection &rc : replay_connections) {
+			if (rc.fd == -1 && rc.type == TRACE_ACCEPT) {
+				if (std::max(rc.time, rc.retry_time) > now) {
+					next_due = std::min(next_due, std::max(rc.time, rc.retry_time));
+					continue;
+				}
+				if (!connect_to_node(rc)) {
+					rc.retry_time = now + REPLAY_RETRY_NS;
+					next_due = std::min(next_due, rc.retry_time);
+					continue;
+				}
+			}
+			if (rc.fd < 0) continue;
+			if (!rc.blocked) play_due(rc, now);
+			if (!rc.blocked && rc.next < rc.events.size()) next_due = std::min(next_due, event_at(rc.events[rc.next])->time_ns);
+		}
+
+		pfds.clear();
+		owners.clear();
+		for (size_t i = 0; i < replay_listeners.size(); i++) {
+			pfds.push_back({ replay_listeners[i].fd, POLLIN, 0 });
+			owners.emplace_back(0, i);
+		}
+		for (size_t i = 0; i < replay_connections.size(); i++) {
+			ReplayConnection &rc = replay_connections[i];
+			if (rc.fd < 0) continue;
+			pfds.push_back({ rc.fd, short(POLLIN | (rc.blocked ? POLLOUT : 0)), 0 });
+			owners.emplace_back(1, i);
+		}
+		for (size_t i = 0; i < replay_extra.size(); i++) {
+			pfds.push_back({ replay_extra[i], POLLIN, 0 });
+			owners.emplace_back(2, i);
+		}
+
+		timespec timeout;
+		if (next_due != UINT64_MAX) timeout = to_timespec(next_due > now ? next_due - now : 0);
+		int ret = ppoll(pfds.data(), pfds.size(), next_due == UINT64_MAX ? nullptr : &timeout, nullptr);
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+			std::cerr << "Replay poll failed: " << strerror(errno) << std::endl;
+			return nullptr;
+		}
+
+		for (size_t i = 0; i < pfds.size(); i++) {
+			if (pfds[i].revents == 0) continue;
+			size_t index = owners[i].second;
+			switch (owners[i].first) {
+			case 0:
+				accept_from_node(replay_listeners[index]);
+				break;
+			case 1: {
+				ReplayConnection &rc = replay_connections[index];
+				if (pfds[i].revents & POLLOUT) rc.blocked = false;
+				if ((pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) && !drain(rc.fd)) {
+					real_close(rc.fd);
+					rc.fd = -2;
+				}
+				break;
+			}
+			case 2:
+				if (!drain(replay_extra[index])) {
+					real_close(replay_extra[index]);
+					replay_extra[index] = -1;
+				}
+				break;
+			}
+		}
+		replay_extra.erase(std::remove(replay_extra.begin(), replay_extra.end(), -1), replay_extra.end());
+	}
+}
+
+bool start_replay(const char* path, int port_shift) {
+	initialize_real_functions();
+	if (!load_trace(path, port_shift) || !open_listeners()) return false;
+
+	replay_start = now_ns();
+	pthread_t thread;
+	if (pthread_create(&thread, nullptr, replay_peers, nullptr) != 0) {
+		std::cerr << "Failed to start replay thread." << std::endl;
+		return false;
+	}
+	pthread_detach(thread);
+	return true;
+}
@@ -0,0 +1,39 @@
+#ifndef REPLAY_HPP
+#define REPLAY_HPP
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/*
+	Record and replay of the traffic between nodes, so one node of a cluster can be profiled on
+	its own. With DCUZ_RECORD set, every read from a tracked connection is appended to the trace
+	`<path_prefix>.<pid>` (see utils/trace.hpp) as it arrived, framing metadata included. A
+	connection is only recorded once it delivers data, so attempts that never connected are left
+	out.
+
+	With DCUZ_REPLAY set to one of those traces, a background thread stands in for the peers. It
+	listens on every address the node connected to, connects to every address peers connected to,
+	and writes each connection's recorded bytes at their recorded times, discarding whatever the
+	node sends back. The replay is open loop: recorded replies arrive on schedule whether or not
+	the node has sent the request yet.
+*/
+
+bool start_recording(const char* path_prefix);
+// Called in a forked child, which records to its own trace
+void reset_recording_after_fork();
+// Writes out whatever is still buffered. Async-signal-safe, for finish_profiling.
+bool flush_recording();
+
+// Called by the socket hooks for tracked connections
+void record_connect(int fd, const struct sockaddr* addr, socklen_t addrlen);
+void record_accept(int fd);
+void record_read(int fd, const char* buf, ssize_t n);
+void record_close(int fd);
+
+/**
+	Starts replaying the trace at `path` from now. Recorded ports are moved by `port_shift`, so a
+	trace taken on one set of ports can be replayed next to other runs on another.
+*/
+bool start_replay(const char* path, int port_shift);
+
+#endif //REPLAY_HPP
@@ -1,70 +1,329 @@
 import argparse
+import csv
+import numpy as np
 import pandas as pd
 import os
+import queue
 import subprocess
+import threading
+import uuid
+from collections import namedtuple
+from concurrent.futures import ThreadPoolExecutor
 from subprocess import DEVNULL
 
 def get_all_mappings(mappings_folder):
     all_mappings = []
     for f in os.listdir(mappings_folder):
-        mapping = pd.read_csv(os.path.join(mappings_folder, f), names=['module', 'source', 'line', 'offset'])
+        mapping = pd.read_csv(os.path.join(mappings_folder, f), header=None)
+        # Older mappings have no size column and are matched on their exact offset
+        mapping.columns = ['module', 'source', 'line', 'offset', 'size'][:len(mapping.columns)]
+        if 'size' not in mapping:
+            mapping['size'] = 1
         all_mappings.append(mapping)
     return pd.concat(all_mappings)
 
-def run_experiment(script, script_args, module, offset, speedup):
+# Must match utils/results.hpp
+RESULTS_MAGIC = b"DCUZRES"
+RESULTS_VERSION = 5
+RESULTS_HEADER_DTYPE = np.dtype([
+    ('magic', 'S8'), ('version', '<u4'), ('header_size', '<u4'), ('record_size', '<u4'), ('reserved', '<u4')
+])
+THREAD_RESULT_DTYPE = np.dtype([('tid', '<u8'), ('hit_counts', '<u8'), ('profile_counts', '<u8')])
+RESULT_RECORD_DTYPE = np.dtype([
+    ('pid', '<u8'), ('run_id', '<u8'), ('module', 'S64'), ('offset', '<u8'), ('speedup', '<f8'),
+    ('hit_counts', '<u8'), ('profile_counts', '<u8'), ('delayed_ns', '<u8'), ('runtime_ns', '<u8'),
+    ('nthreads', '<u4'), ('size', '<u4'), ('self_hits', '<u8'), ('inclusive_hits', '<u8'),
+    ('attribution', '<u4'), ('callchain_depth', '<u4'),
+    ('overhead_ns', '<u8'), ('overhead_spans', '<u8'), ('overhead_span_cost_ns', '<u8'),
+    ('threads', THREAD_RESULT_DTYPE, (14,))
+])
+
+def read_results(path):
+    """
+    Maps the binary results file written by dcuz.so as a numpy record array.
+    """
+    if not os.path.exists(path) or os.path.getsize(path) == 0:
+        return np.empty(0, dtype=RESULT_RECORD_DTYPE)
+
+    header = np.fromfile(path, dtype=RESULTS_HEADER_DTYPE, count=1)[0]
+    if header['magic'] != RESULTS_MAGIC or header['version'] != RESULTS_VERSION:
+        raise ValueError(f"{path} is not a version {RESULTS_VERSION} DCuz results file")
+    if header['record_size'] != RESULT_RECORD_DTYPE.itemsize:
+        raise ValueError(f"{path} has {header['record_size']} byte records, expected {RESULT_RECORD_DTYPE.itemsize}")
+
+    n_records = (os.path.getsize(path) - header['header_size']) // header['record_size']
+    if n_records == 0:
+        return np.empty(0, dtype=RESULT_RECORD_DTYPE)
+    return np.memmap(path, dtype=RESULT_RECORD_DTYPE, mode='r', offset=int(header['header_size']), shape=(n_records,))
+
+def run_experiment(script, script_args, module, offset, size, speedup, results_path, cpus=None, extra_env=None,
+                   subtract_overhead=False):
+    """
+    Runs the script once under dcuz.so and returns its virtual time, or None if the script's
+    process wrote no result record, e.g. because it crashed or never started profiling.
+    """
     env = dict(os.environ)
+    env.update(extra_env or {})
     env['LD_PRELOAD'] = './dcuz.so'
     env['DCUZ_MODULE'] = module
     env['DCUZ_OFFSET'] = offset
+    env['DCUZ_SIZE'] = str(size)
     env['DCUZ_SPEEDUP'] = str(speedup)
+    env['DCUZ_RESULTS'] = results_path
+    # Pids wrap over a long sweep, so the run is found by an ID of its own
+    run_id = uuid.uuid4().int & (2 ** 63 - 1)
+    env['DCUZ_RUN_ID'] = str(run_id)
 
-    process = subprocess.Popen([script, *script_args], stdout=DEVNULL, stderr=DEVNULL, env=env)
+    # Affinity is inherited, so every process the script forks stays on these CPUs. taskset sets it
+    # rather than a preexec_fn, which isn't safe from the scheduler's threads. taskset and env exec
+    # in place, so the pid is still the script's, and only the script gets dcuz.so.
+    command = [script, *script_args]
+    if cpus:
+        del env['LD_PRELOAD']
+        command = ['taskset', '-c', ','.join(map(str, cpus)), 'env', 'LD_PRELOAD=./dcuz.so', *command]
+    process = subprocess.Popen(command, stdout=DEVNULL, stderr=DEVNULL, env=env)
     pid = process.pid
     process.wait()
 
-    with open(f"{pid}.txt", 'r') as f:
-        lines = f.readlines()
-        virtual_time = int(lines[-1]) - int(lines[-2])
+    results = read_results(results_path)
+    records = results[(results['run_id'] == run_id) & (results['pid'] == pid)]
+    if len(records) == 0:
+        return None
+    record = records[-1]
+    virtual_time = int(record['runtime_ns']) - int(record['delayed_ns'])
+    # The hooks' own cost is summed over threads, so it can overshoot on multithreaded processes
+    if subtract_overhead:
+        virtual_time -= min(int(record['overhead_ns']), virtual_time)
 
     return virtual_time
 
+# One run of the script. Experiments are repeated across adaptive rounds, and baselines within a
+# round are told apart by rep.
+Experiment = namedtuple('Experiment', ['line', 'module', 'offset', 'size', 'speedup', 'round', 'rep'], defaults=[0, 0])
+
+def experiment_key(line, offset, speedup, round, rep):
+    return (line, offset, float(speedup), int(round), int(rep))
+
+class Scheduler:
+    """
+    Runs experiments on `jobs` parallel slots. Each slot owns a disjoint set of CPUs, a port range
+    and a data directory, which are substituted into the script arguments wherever {slot}, {port}
+    or {dir} appear. Every finished experiment is appended to the output CSV right away, and
+    experiments already in it are skipped, so an interrupted sweep resumes where it stopped.
+    """
+    COLUMNS = ['line', 'offset', 'speedup', 'round', 'rep', 'result']
+
+    def __init__(self, args):
+        self.args = args
+        self.results_path = os.path.abspath(args.raw_results)
+        self.lock = threading.Lock()
+
+        cpus = sorted(os.sched_getaffinity(0))
+        per_slot = len(cpus) // args.jobs
+        if per_slot == 0:
+            raise ValueError(f"Can't run {args.jobs} jobs on {len(cpus)} CPUs")
+
+        self.free_slots = queue.Queue()
+        for slot in range(args.jobs):
+            self.free_slots.put({
+                'slot': slot,
+                'cpus': cpus[slot * per_slot:(slot + 1) * per_slot],
+                'port': args.port_base + slot * args.port_stride,
+                'dir': os.path.join(args.data_dir, str(slot)),
+            })
+
+        self.done = set()
+        if os.path.exists(args.output):
+            for _, row in pd.read_csv(args.output).iterrows():
+                self.done.add(experiment_key(row['line'], row['offset'], row['speedup'],
+                                             row.get('round', 0), row.get('rep', 0)))
+            print(f"Resuming, {len(self.done)} experiments already done")
+
+    def _run(self, e, extra_env):
+        slot = self.free_slots.get()
+        try:
+            script_args = [a.format(slot=slot['slot'], port=slot['port'], dir=slot['dir'])
+                           for a in self.args.script_args]
+            result = run_experiment(self.args.script, script_args, e.module, e.offset, e.size, e.speedup,
+                                    self.results_path, slot['cpus'], extra_env, self.args.subtract_overhead)
+        finally:
+            self.free_slots.put(slot)
+
+        # Left out of the output, so resuming runs it again
+        if result is None:
+            print(f"{e.line} with {e.speedup * 100}% speedup failed: no result record")
+            return None
+
+        with self.lock:
+            write_header = not os.path.exists(self.args.output)
+            with open(self.args.output, 'a', newline='') as f:
+                writer = csv.writer(f)
+                if write_header:
+                    writer.writerow(self.COLUMNS)
+                writer.writerow([e.line, e.offset, e.speedup, e.round, e.rep, result])
+        print(f"{e.line} with {e.speedup * 100}% speedup had {result}")
+        return result
+
+    def run_all(self, experiments, extra_env=None):
+        """
+        Runs every experiment not already in the output, in order as slots free up.
+        """
+        todo = [e for e in experiments
+                if experiment_key(e.line, e.offset, e.speedup, e.round, e.rep) not in self.done]
+        with ThreadPoolExecutor(max_workers=self.args.jobs) as executor:
+            for future in [executor.submit(self._run, e, extra_env) for e in todo]:
+                future.result()
+
+def line_sample_shares(histogram_path, mappings):
+    """
+    Attributes the sampled offsets from a DCUZ_IP_HISTOGRAM dump to mapped lines. The dump names
+    modules by their loaded path, which matches a mapping's module the same way DCUZ_MODULE does,
+    by substring. A sample belongs to the mapping row whose address range contains it. Returns each line's share of its
+    module's samples, along with its most sampled range to experiment on.
+    """
+    hist = pd.read_csv(histogram_path, names=['module', 'offset', 'count'])
+    hist['offset'] = hist['offset'].apply(lambda x: int(x, 16))
+
+    shares = []
+    for module, rows in mappings.groupby('module'):
+        rows = rows.assign(int_offset=rows['offset'].apply(lambda x: int(x, 16))).sort_values('int_offset')
+        offsets = rows['int_offset'].to_numpy()
+        samples = hist[hist['module'].str.contains(module, regex=False)].groupby('offset')['count'].sum()
+        total = samples.sum()
+        if total == 0:
+            continue
+
+        sample_offsets = samples.index.to_numpy()
+        idx = np.searchsorted(offsets, sample_offsets, side='right') - 1
+        ends = offsets + rows['size'].to_numpy()
+        valid = (idx >= 0) & (sample_offsets < ends[np.maximum(idx, 0)])
+        per_row = np.bincount(idx[valid], weights=samples.to_numpy()[valid], minlength=len(offsets))
+
+        rows = rows.assign(samples=per_row, line_id=rows['source'] + ':' + rows['line'].astype(str))
+        for line, line_rows in rows.groupby('line_id'):
+            best = line_rows.loc[line_rows['samples'].idxmax()]
+            shares.append({'line': line, 'module': module, 'offset': best['offset'], 'size': best['size'],
+                           'share': line_rows['samples'].sum() / total})
+    return pd.DataFrame(shares, columns=['line', 'module', 'offset', 'size', 'share'])
+
+def speedup_impact(results, line):
+    """
+    Fits runtime against speedup for `line`, with every result normalized by the mean baseline of
+    its round to cancel out drift. That round's baselines are included as speedup 0 points.
+    Returns the slope and its 95% confidence interval, as a fraction of baseline runtime.
+    """
+    baselines = results[results['line'] == 'baseline']
+    baseline_means = baselines.groupby('round')['result'].mean()
+
+    rows = results[results['line'] == line]
+    rows = pd.concat([rows, baselines[baselines['round'].isin(rows['round'])]])
+    rows = rows[rows['round'].isin(baseline_means.index)]
+    if len(rows) < 3:
+        return None
+
+    x = rows['speedup'].to_numpy(dtype=float)
+    y = (rows['result'] / rows['round'].map(baseline_means)).to_numpy(dtype=float)
+    sxx = np.sum((x - x.mean()) ** 2)
+    if sxx == 0:
+        return None
+    slope = np.sum((x - x.mean()) * (y - y.mean())) / sxx
+    residuals = y - (y.mean() + slope * (x - x.mean()))
+    stderr = np.sqrt(np.sum(residuals ** 2) / (len(x) - 2) / sxx)
+    return slope, slope - 1.96 * stderr, slope + 1.96 * stderr
+
+def run_adaptive(args, mappings, scheduler, speedups):
+    """
+    Ranks lines with a profiling pass, then runs rounds of speedup experiments on lines with at
+    least --min_share of the samples. Baselines are interleaved every --baseline_every experiments,
+    and a line stops once the confidence interval of its impact excludes zero, or fits inside
+    +/- --zero_band.
+    """
+    # The histogram covers every loaded module, so one set of runs profiles all of them
+    histogram_path = os.path.abspath(args.output + '.ips.csv')
+    first = mappings.iloc[0]
+    profile_runs = [Experiment('baseline', first['module'], first['offset'], first['size'], 0, 0, rep)
+                    for rep in range(args.profile_runs)]
+    scheduler.run_all(profile_runs, extra_env={'DCUZ_IP_HISTOGRAM': histogram_path})
+
+    shares = line_sample_shares(histogram_path, mappings).sort_values('share', ascending=False)
+    active = shares[shares['share'] >= args.min_share]
+    print(f"{len(active)} of {len(shares)} sampled lines have at least {args.min_share:.2%} of samples")
+
+    summary = {}
+    for rnd in range(1, args.max_rounds + 1):
+        if len(active) == 0:
+            break
+
+        experiments = []
+        for _, row in active.iterrows():
+            for speedup in speedups:
+                if len(experiments) % (args.baseline_every + 1) == 0:
+                    rep = len(experiments) // (args.baseline_every + 1)
+                    experiments.append(Experiment('baseline', first['module'], first['offset'], first['size'], 0, rnd, rep))
+                experiments.append(Experiment(row['line'], row['module'], row['offset'], row['size'], speedup, rnd))
+        scheduler.run_all(experiments)
+
+        results = pd.read_csv(args.output)
+        still_active = []
+        for index, row in active.iterrows():
+            impact = speedup_impact(results, row['line'])
+            status = 'running'
+            if impact is not None:
+                slope, lo, hi = impact
+                if lo > 0 or hi < 0:
+                    status = 'impact'
+                elif -args.zero_band < lo and hi < args.zero_band:
+                    status = 'no impact'
+                summary[row['line']] = {'line': row['line'], 'share': row['share'], 'slope': slope,
+                                        'ci_low': lo, 'ci_high': hi, 'status': status, 'rounds': rnd}
+            if status == 'running':
+                still_active.append(index)
+            else:
+                print(f"{row['line']}: {status} after {rnd} rounds, slope {slope:.4f} [{lo:.4f}, {hi:.4f}]")
+        active = active.loc[still_active]
+
+    pd.DataFrame(list(summary.values())).to_csv(args.output + '.lines.csv', index=False)
 
 if __name__ == "__main__":
     parser = argparse.ArgumentParser(prog='DCuz')
     parser.add_argument('-m', '--mappings', help="Folder of source code mappings to experiment with")
     parser.add_argument('--min_experiments', default=5, type=int)
-    parser.add_argument('-o', '--output', default="results.csv", help="Output CSV File")
+    parser.add_argument('-o', '--output', default="results.csv", help="Output CSV File, also used to resume")
+    parser.add_argument('-r', '--raw_results', default="dcuz_results.bin", help="Binary file the profiler appends run records to")
+    parser.add_argument('-j', '--jobs', default=1, type=int, help="Experiments to run in parallel, each on its own CPUs")
+    parser.add_argument('--port_base', default=9000, type=int, help="First port handed to slot 0 as {port}")
+    parser.add_argument('--port_stride', default=100, type=int, help="Ports between consecutive slots' {port}")
+    parser.add_argument('--data_dir', default="/tmp/dcuz", help="Slot data dirs ({dir}) are created under this")
+    parser.add_argument('--subtract_overhead', action='store_true',
+                        help="Also subtract the time spent in DCuz's own hooks from each run's runtime")
+    parser.add_argument('--adaptive', action='store_true', help="Profile first and only experiment on hot lines until decided")
+    parser.add_argument('--profile_runs', default=3, type=int, help="Adaptive: runs in the profiling pass")
+    parser.add_argument('--min_share', default=0.001, type=float, help="Adaptive: skip lines with a smaller share of samples")
+    parser.add_argument('--baseline_every', default=10, type=int, help="Adaptive: experiments between interleaved baselines")
+    parser.add_argument('--max_rounds', default=10, type=int, help="Adaptive: give up on a line after this many rounds")
+    parser.add_argument('--zero_band', default=0.01, type=float,
+                        help="Adaptive: a line has no impact once its slope CI is within +/- this fraction of runtime")
     parser.add_argument("script", help="The script to run")
-    parser.add_argument("script_args", nargs="*", help="Script arguments", default=[])
+    parser.add_argument("script_args", nargs="*", default=[],
+                        help="Script arguments. {slot}, {port} and {dir} are replaced per parallel slot")
 
     args = parser.parse_args()
+    os.makedirs(args.data_dir, exist_ok=True)
 
     all_mappings = get_all_mappings(args.mappings)
     print(all_mappings.head())
 
     speedups = [0.2, 0.4, 0.6, 0.8, 1]
-    experiment_results = []
-    i = 0
-    for index, rows in all_mappings.iterrows():
-        for speedup in speedups:
-            result = run_experiment(args.script, args.script_args, rows['module'], rows['offset'], speedup)
-            experiment_results.append({
-                'line': f"{rows['source']}:{rows['line']}",
-                'speedup': speedup,
-                'result': result
-            })
-            print(f"{rows['source']}:{rows['line']} with {speedup * 100}% speedup had {result}")
-
-        # Occasionally save progress
-        i += 1
-        if i % 100 == 0:
-            pd.DataFrame(experiment_results).to_csv(args.output, index=False)
-    baseline = run_experiment(args.script, args.script_args,
-                              all_mappings.loc[0, 'module'], all_mappings.loc[0, 'offset'], 0)
-    experiment_results.append({
-        'line': "baseline",
-        'speedup': 0,
-        'result': baseline
-    })
-
-    pd.DataFrame(experiment_results).to_csv(args.output, index=False)
+    scheduler = Scheduler(args)
+    if args.adaptive:
+        run_adaptive(args, all_mappings, scheduler, speedups)
+    else:
+        experiments = []
+        for index, rows in all_mappings.iterrows():
+            for speedup in speedups:
+                experiments.append(Experiment(f"{rows['source']}:{rows['line']}", rows['module'], rows['offset'], rows['size'], speedup))
+
+        first = all_mappings.iloc[0]
+        experiments.append(Experiment("baseline", first['module'], first['offset'], first['size'], 0))
+
+        scheduler.run_all(experiments)
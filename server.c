@@ -2,17 +2,75 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "../include/raft.h"
 #include "../include/raft/uv.h"
 
-#define N_SERVERS 3    /* Number of servers in the example cluster */
-#define APPLY_RATE 10 /* Apply a new entry every 125 milliseconds */
+#define POLL_RATE 1 /* Check for leadership and pace open-loop load every millisecond */
 
 #define Log(SERVER_ID, FORMAT) printf("%d: " FORMAT "\n", SERVER_ID)
 #define Logf(SERVER_ID, FORMAT, ...) \
     printf("%d: " FORMAT "\n", SERVER_ID, __VA_ARGS__)
 
+/********************************************************************
+ *
+ * Benchmark load, set from the command line.
+ *
+ ********************************************************************/
+
+struct Load
+{
+    unsigned n_servers;     /* Nodes in the cluster. */
+    size_t entry_size;      /* Bytes per entry, at least the 8 byte increment. */
+    unsigned concurrency;   /* Closed loop: raft_apply calls kept in flight. */
+    unsigned long long ops; /* Entries to commit before stopping. */
+    double rate;            /* Open loop: entries per second, 0 for closed loop. */
+};
+
+static struct Load load = {3, sizeof(uint64_t), 1, 100, 0};
+
+/* Parses the load options, leaving optind at the first positional argument.
+ * The cluster passes its own options through unchanged. */
+static int parseLoad(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:c:t:r:")) != -1) {
+        switch (opt) {
+            case 'n':
+                load.n_servers = (unsigned)atoi(optarg);
+                break;
+            case 's':
+                load.entry_size = (size_t)strtoull(optarg, NULL, 10);
+                break;
+            case 'c':
+                load.concurrency = (unsigned)atoi(optarg);
+                break;
+            case 't':
+                load.ops = strtoull(optarg, NULL, 10);
+                break;
+            case 'r':
+                load.rate = atof(optarg);
+                break;
+            default:
+                return -1;
+        }
+    }
+    if (load.n_servers == 0 || load.entry_size < sizeof(uint64_t) ||
+        load.concurrency == 0 || load.ops == 0 || load.rate < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static uint64_t nowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
 /********************************************************************
  *
  * Sample application FSM that just increases a counter.
@@ -30,11 +88,11 @@ static int FsmApply(struct raft_fsm *fsm,
                     void **result)
 {
     struct Fsm *f = fsm->data;
-    if (buf->len != 8) {
+    if (buf->len < sizeof(uint64_t)) {
         return RAFT_MALFORMED;
     }
     f->count += *(uint64_t *)buf->base;
-    if (f->count > 100) f->stopped = true;
+    if (f->count >= load.ops) f->stopped = true;
 
     *result = &f->count;
     return 0;
@@ -108,7 +166,7 @@ struct Server
 {
     void *data;                         /* User data context. */
     struct uv_loop_s *loop;             /* UV loop. */
-    struct uv_timer_s timer;            /* To periodically apply a new entry. */
+    struct uv_timer_s timer;            /* To wait for leadership and pace the load. */
     const char *dir;                    /* Data dir of UV I/O backend. */
     struct raft_uv_transport transport; /* UV I/O backend transport. */
     struct raft_io io;                  /* UV I/O backend. */
@@ -118,6 +176,21 @@ struct Server
     struct raft raft;                   /* Raft instance. */
     struct raft_transfer transfer;      /* Transfer leadership request. */
     ServerCloseCb close_cb;             /* Optional close callback. */
+    uint64_t load_start;                /* When this server started as leader. */
+    unsigned long long submitted;       /* Entries passed to raft_apply. */
+    unsigned long long committed;       /* Entries whose apply callback succeeded. */
+    unsigned long long failed;          /* Entries whose apply callback failed. */
+    unsigned in_flight;                 /* Entries submitted but not called back. */
+    uint64_t *latencies;                /* Commit latency of each committed entry. */
+    bool reported;                      /* Whether the stats were written. */
+};
+
+/* A raft_apply request, and when its entry should have been submitted. */
+struct ApplyReq
+{
+    struct raft_apply req;
+    struct Server *s;
+    uint64_t start;
 };
 
 static void serverRaftCloseCb(struct raft *raft)
@@ -126,6 +199,7 @@ static void serverRaftCloseCb(struct raft *raft)
     raft_uv_close(&s->io);
     raft_uv_tcp_close(&s->transport);
     FsmClose(&s->fsm);
+    free(s->latencies);
     if (s->close_cb != NULL) {
         s->close_cb(s);
     }
@@ -163,7 +237,8 @@ static void serverTimerCloseCb(struct uv_handle_s *handle)
 static int ServerInit(struct Server *s,
                       struct uv_loop_s *loop,
                       const char *dir,
-                      unsigned id)
+                      unsigned id,
+                      unsigned port_base)
 {
     struct raft_configuration configuration;
     struct timespec now;
@@ -177,6 +252,7 @@ static int ServerInit(struct Server *s,
     srandom((unsigned)(now.tv_nsec ^ now.tv_sec));
 
     s->loop = loop;
+    s->dir = dir;
 
     /* Add a timer to periodically try to propose a new entry. */
     rv = uv_timer_init(s->loop, &s->timer);
@@ -212,7 +288,7 @@ static int ServerInit(struct Server *s,
     s->id = id;
 
     /* Render the address. */
-    sprintf(s->address, "127.0.0.1:900%d", id);
+    sprintf(s->address, "127.0.0.1:%u", port_base + id);
 
     raft_uv_set_connect_retry_delay(&s->io, 10);
 
@@ -226,10 +302,10 @@ static int ServerInit(struct Server *s,
 
     /* Bootstrap the initial configuration if needed. */
     raft_configuration_init(&configuration);
-    for (i = 0; i < N_SERVERS; i++) {
+    for (i = 0; i < load.n_servers; i++) {
         char address[64];
         unsigned server_id = i + 1;
-        sprintf(address, "127.0.0.1:900%d", server_id);
+        sprintf(address, "127.0.0.1:%u", port_base + server_id);
         rv = raft_configuration_add(&configuration, server_id, address,
                                     RAFT_VOTER);
         if (rv != 0) {
@@ -249,6 +325,12 @@ static int ServerInit(struct Server *s,
 
     s->transfer.data = s;
 
+    s->latencies = malloc(load.ops * sizeof *s->latencies);
+    if (s->latencies == NULL) {
+        rv = RAFT_NOMEM;
+        goto err_after_fsm_init;
+    }
+
     return 0;
 
 err_after_configuration_init:
@@ -263,37 +345,162 @@ err:
     return rv;
 }
 
+static int compareLatency(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile of the sorted latencies. */
+static uint64_t percentile(const uint64_t *sorted, unsigned long long n, double p)
+{
+    unsigned long long rank;
+    if (n == 0) {
+        return 0;
+    }
+    rank = (unsigned long long)(p * (double)n + 0.999999);
+    if (rank < 1) {
+        rank = 1;
+    }
+    if (rank > n) {
+        rank = n;
+    }
+    return sorted[rank - 1];
+}
+
+/* Writes the load and its results as a JSON object to <dir>/stats.json, for
+ * the cluster to report. Only the leader has latencies to report. */
+static void serverReport(struct Server *s)
+{
+    char path[1024];
+    uint64_t elapsed = nowNs() - s->load_start;
+    FILE *out;
+
+    s->reported = true;
+    qsort(s->latencies, s->committed, sizeof *s->latencies, compareLatency);
+
+    snprintf(path, sizeof path, "%s/stats.json", s->dir);
+    out = fopen(path, "w");
+    if (out == NULL) {
+        Logf(s->id, "can't write %s", path);
+        return;
+    }
+    fprintf(out,
+            "{\"leader\":%u,\"nodes\":%u,\"entry_size\":%zu,"
+            "\"concurrency\":%u,\"rate\":%g,\"ops\":%llu,\"failed\":%llu,"
+            "\"elapsed_ns\":%llu,\"throughput_ops\":%.1f,"
+            "\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu}\n",
+            s->id, load.n_servers, load.entry_size, load.concurrency,
+            load.rate, s->committed, s->failed, (unsigned long long)elapsed,
+            elapsed ? (double)s->committed * 1e9 / (double)elapsed : 0.0,
+            (unsigned long long)percentile(s->latencies, s->committed, 0.5),
+            (unsigned long long)percentile(s->latencies, s->committed, 0.99),
+            (unsigned long long)percentile(s->latencies, s->committed, 0.999));
+    fclose(out);
+}
+
+static void serverApplyCb(struct raft_apply *req, int status, void *result);
+
+/* Proposes one entry, timing its commit from `start`. */
+static int serverSubmit(struct Server *s, uint64_t start)
+{
+    struct raft_buffer buf;
+    struct ApplyReq *apply;
+    int rv;
+
+    buf.len = load.entry_size;
+    buf.base = raft_malloc(buf.len);
+    if (buf.base == NULL) {
+        Log(s->id, "serverSubmit(): out of memory");
+        return RAFT_NOMEM;
+    }
+    memset(buf.base, 0, buf.len);
+    *(uint64_t *)buf.base = 1;
+
+    apply = raft_malloc(sizeof *apply);
+    if (apply == NULL) {
+        Log(s->id, "serverSubmit(): out of memory");
+        raft_free(buf.base);
+        return RAFT_NOMEM;
+    }
+    apply->req.data = apply;
+    apply->s = s;
+    apply->start = start;
+
+    rv = raft_apply(&s->raft, &apply->req, &buf, 1, serverApplyCb);
+    if (rv != 0) {
+        Logf(s->id, "raft_apply(): %s", raft_errmsg(&s->raft));
+        raft_free(buf.base);
+        raft_free(apply);
+        return rv;
+    }
+    s->submitted++;
+    s->in_flight++;
+    return 0;
+}
+
+/* Closed loop: keep `concurrency` entries in flight until all are submitted. */
+static void serverFill(struct Server *s)
+{
+    while (s->raft.state == RAFT_LEADER && s->in_flight < load.concurrency &&
+           s->submitted < load.ops) {
+        if (serverSubmit(s, nowNs()) != 0) {
+            return;
+        }
+    }
+}
+
+/* Open loop: submit every entry that is due by now, whatever is in flight.
+ * Latency counts from when each entry was due, so a backlog shows up in it. */
+static void serverPace(struct Server *s)
+{
+    uint64_t now = nowNs();
+    while (s->raft.state == RAFT_LEADER && s->submitted < load.ops) {
+        uint64_t due = s->load_start + (uint64_t)((double)s->submitted * 1e9 / load.rate);
+        if (due > now || serverSubmit(s, due) != 0) {
+            return;
+        }
+    }
+}
+
 /* Called after a request to apply a new command to the FSM has been
  * completed. */
 static void serverApplyCb(struct raft_apply *req, int status, void *result)
 {
-    struct Server *s = req->data;
-    // int count;
-    raft_free(req);
+    struct ApplyReq *apply = req->data;
+    struct Server *s = apply->s;
+    uint64_t start = apply->start;
+    (void)result;
+    raft_free(apply);
+    s->in_flight--;
     if (status != 0) {
         if (status != RAFT_LEADERSHIPLOST) {
             Logf(s->id, "raft_apply() callback: %s (%d)", raft_errmsg(&s->raft),
                  status);
         }
+        s->failed++;
+    } else {
+        s->latencies[s->committed++] = nowNs() - start;
+    }
+
+    /* A failed entry can be the last one outstanding, so check both. */
+    if (s->committed + s->failed == load.ops) {
+        serverReport(s);
         return;
     }
-    // count = *(int *)result;
-    /*if (count % 1000 == 0) {
-        Logf(s->id, "count %d", count);
-    }*/
+    if (status == 0 && load.rate == 0) {
+        serverFill(s);
+    }
 }
 
-/* Called periodically every APPLY_RATE milliseconds. */
+/* Called periodically every POLL_RATE milliseconds. */
 static void serverTimerCb(uv_timer_t *timer)
 {
     struct Server *s = timer->data;
-    struct raft_buffer buf;
-    struct raft_apply *req;
-    int rv;
 
     struct Fsm *f = s->fsm.data;
-    //Logf(s->id, "%llu", f->count);
-    if (f->stopped){
+    if (f->stopped && (s->submitted == 0 || s->reported)) {
         Log(s->id, "stopping");
         raise(SIGINT);
     }
@@ -302,26 +509,13 @@ static void serverTimerCb(uv_timer_t *timer)
         return;
     }
 
-    buf.len = sizeof(uint64_t);
-    buf.base = raft_malloc(buf.len);
-    if (buf.base == NULL) {
-        Log(s->id, "serverTimerCb(): out of memory");
-        return;
+    if (s->load_start == 0) {
+        s->load_start = nowNs();
     }
-
-    *(uint64_t *)buf.base = 1;
-
-    req = raft_malloc(sizeof *req);
-    if (req == NULL) {
-        Log(s->id, "serverTimerCb(): out of memory");
-        return;
-    }
-    req->data = s;
-
-    rv = raft_apply(&s->raft, req, &buf, 1, serverApplyCb);
-    if (rv != 0) {
-        Logf(s->id, "raft_apply(): %s", raft_errmsg(&s->raft));
-        return;
+    if (load.rate == 0) {
+        serverFill(s);
+    } else {
+        serverPace(s);
     }
 }
 
@@ -337,7 +531,7 @@ static int ServerStart(struct Server *s)
         Logf(s->id, "raft_start(): %s", raft_errmsg(&s->raft));
         goto err;
     }
-    rv = uv_timer_start(&s->timer, serverTimerCb, 0, APPLY_RATE);
+    rv = uv_timer_start(&s->timer, serverTimerCb, 0, POLL_RATE);
     if (rv != 0) {
         Logf(s->id, "uv_timer_start(): %s", uv_strerror(rv));
         goto err;
@@ -397,14 +591,19 @@ int main(int argc, char *argv[])
     struct Server server;
     const char *dir;
     unsigned id;
+    unsigned port_base = 9000;
     int rv;
 
-    if (argc != 3) {
-        printf("usage: example-server <dir> <id>\n");
+    if (parseLoad(argc, argv) != 0 || (argc - optind != 2 && argc - optind != 3)) {
+        printf("usage: example-server [-n nodes] [-s entry size] [-c concurrency] "
+               "[-t ops] [-r rate] <dir> <id> [<port base>]\n");
         return 1;
     }
-    dir = argv[1];
-    id = (unsigned)atoi(argv[2]);
+    dir = argv[optind];
+    id = (unsigned)atoi(argv[optind + 1]);
+    if (argc - optind == 3) {
+        port_base = (unsigned)atoi(argv[optind + 2]);
+    }
 
     /* Ignore SIGPIPE, see https://github.com/joyent/libuv/issues/1254 */
     signal(SIGPIPE, SIG_IGN);
@@ -417,7 +616,7 @@ int main(int argc, char *argv[])
     }
 
     /* Initialize the example server. */
-    rv = ServerInit(&server, &loop, dir, id);
+    rv = ServerInit(&server, &loop, dir, id, port_base);
     if (rv != 0) {
         goto err_after_server_init;
     }
@@ -5,7 +5,10 @@
 #include <dlfcn.h>
 #include <ctime>
 #include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <vector>
+#include <deque>
 #include <unordered_map>
 #include <utility>
 #include <sys/epoll.h>
@@ -13,23 +16,31 @@
 #include <stdexcept>
 #include <iostream>
 #include <fcntl.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/file.h>
 
 #include "utils/mempool.hpp"
 #include "utils/time.hpp"
 #include "utils/packetqueue.hpp"
 #include "socket_hook.hpp"
+#include "delay.hpp"
+#include "forkserver.hpp"
+#include "overhead.hpp"
 #include "profiler.hpp"
+#include "replay.hpp"
 
 constexpr size_t MAGIC = 0xabcdeffedcba;
 constexpr size_t PACKET_SIZE = 1024;
+constexpr size_t HEADER_SIZE = sizeof(MAGIC) + sizeof(PacketMetadata);
+// Largest datagram we frame or receive whole, header included
+constexpr size_t MAX_DATAGRAM = 65536;
 
-typedef ssize_t(*read_t)(int fd, void *buf, size_t count);
-typedef ssize_t(*write_t)(int fd, const void *buf, size_t count);
-typedef int(*epoll_pwait_t)(int epfd, struct epoll_event events[], int maxevents, int timeout, const sigset_t* sigmask);
-typedef int(*close_t)(int fd);
-typedef int(*connect_t)(int sockfd, const struct sockaddr *addr, socklen_t addrlen);
-typedef int(*accept_t)(int sockfd, struct sockaddr *addr, socklen_t *addrlen);
-typedef int(*accept4_t)(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags);
+// A queued datagram's buffer starts with where it came from, followed by its payload
+struct DatagramSource {
+	socklen_t len;
+	sockaddr_storage addr;
+};
 
 read_t real_read = nullptr;
 write_t real_write = nullptr;
@@ -38,14 +49,94 @@ close_t real_close = nullptr;
 connect_t real_connect = nullptr;
 accept_t real_accept = nullptr;
 accept4_t real_accept4 = nullptr;
+pipe_t real_pipe = nullptr;
+pipe2_t real_pipe2 = nullptr;
+socketpair_t real_socketpair = nullptr;
+sendto_t real_sendto = nullptr;
+sendmsg_t real_sendmsg = nullptr;
+sendmmsg_t real_sendmmsg = nullptr;
+recvfrom_t real_recvfrom = nullptr;
+recvmsg_t real_recvmsg = nullptr;
+recvmmsg_t real_recvmmsg = nullptr;
+shutdown_t real_shutdown = nullptr;
+socket_t real_socket = nullptr;
+
+std::atomic<bool> track_pipes(false);
+thread_local int signal_depth __attribute__((tls_model("initial-exec"))) = 0;
 
 std::vector<std::pair<int, PacketQueue*>> fds;
 MemoryPool mp(1024, PACKET_SIZE);
+FdMetrics fd_metrics[MAX_METRICS_FDS];
+
+/*
+	What each fd is, learned with SO_TYPE the first time it's needed and forgotten when it closes,
+	so sends and receives on untracked fds don't each cost a getsockopt. Datagram sockets (UDP,
+	SOCK_SEQPACKET) keep their message boundaries, and are framed one datagram at a time.
+*/
+enum class SocketKind : uint8_t { UNKNOWN, STREAM, DATAGRAM, NOT_SOCKET };
+static std::atomic<SocketKind> socket_kinds[MAX_METRICS_FDS];
+// Scratch for framing a datagram, or taking in a stream read
+static thread_local char io_buf[MAX_DATAGRAM];
+// Datagrams taken by one recvmmsg, MAX_DATAGRAM apart, allocated on a thread's first receive
+constexpr unsigned int DATAGRAM_BATCH = 8;
+static thread_local std::vector<char> datagram_batch;
+
+/*
+	Where a stream socket's decoding stopped at the end of its last read: a header cut short, or
+	a packet whose payload hasn't all arrived. Reads never block for the rest, so it carries over.
+*/
+struct FrameDecoder {
+	char header[HEADER_SIZE];
+	size_t header_len;
+	Packet partial;
+};
+static std::unordered_map<int, FrameDecoder> frame_decoders;
+
+// Most a stream buffers between flushes when coalescing
+constexpr size_t COALESCE_BYTES = 16 * PACKET_SIZE;
+
+// Framed writes to one fd waiting to be sent together, guarded by `lock`
+struct Coalescer {
+	std::atomic_flag lock = ATOMIC_FLAG_INIT;
+	bool socket;          // Sockets are sent to with MSG_MORE, pipes just written
+	size_t len;
+	time_ns first_write;  // When the oldest buffered frame was written
+	int error;            // What a background flush failed with, reported by the next write
+	char buf[COALESCE_BYTES];
+};
+static time_ns coalesce_ns = 0;
+// Allocated the first time each fd is tracked, and kept for whatever reuses it
+static std::atomic<Coalescer*> coalescers[MAX_METRICS_FDS];
+// Bit per fd with something buffered, so flushes only look at those
+static std::atomic<uint64_t> pending_output[MAX_METRICS_FDS / 64];
+
+static void set_pending(int fd, bool pending) {
+	uint64_t bit = uint64_t(1) << (fd % 64);
+	if (pending) {
+		pending_output[fd / 64].fetch_or(bit, std::memory_order_relaxed);
+	} else {
+		pending_output[fd / 64].fetch_and(~bit, std::memory_order_relaxed);
+	}
+}
+
+std::atomic<bool> record_histograms(false);
+// The open connection on each fd, and every connection ever tracked, newest first
+static std::atomic<ConnectionHistograms*> connection_histograms[MAX_METRICS_FDS];
+static std::atomic<ConnectionHistograms*> all_connections(nullptr);
+// Over every connection
+static ConnectionHistograms total_histograms;
+// Closed connections are dumped on their own up to MAX_RETIRED_CONNECTIONS. Older ones are folded
+// into retired_histograms, and their histograms reused for new connections.
+constexpr size_t MAX_RETIRED_CONNECTIONS = 256;
+static ConnectionHistograms retired_histograms;
+static std::deque<ConnectionHistograms*> retired_connections;
+static std::vector<ConnectionHistograms*> free_connections;
+static std::atomic_flag retire_lock = ATOMIC_FLAG_INIT;
 
 extern Profiler p;
 extern size_t delay_length_ns;
-extern uint64_t delayed_ns;
-timespec last_blocking_time;
+extern std::atomic<uint64_t> delayed_ns;
+time_ns last_blocking_time;
 
 PacketQueue* get_packet_queue(int fd) {
 	for (int i = 0; i < fds.size(); i++) {
@@ -54,6 +145,283 @@ PacketQueue* get_packet_queue(int fd) {
 	return nullptr;
 }
 
+FdMetrics* get_fd_metrics(int fd) {
+	if (fd < 0 || fd >= MAX_METRICS_FDS) return nullptr;
+	return &fd_metrics[fd];
+}
+
+static FrameDecoder* get_frame_decoder(int fd) {
+	auto it = frame_decoders.find(fd);
+	return it == frame_decoders.end() ? nullptr : &it->second;
+}
+
+static SocketKind kind_of_type(int type) {
+	type &= ~(SOCK_NONBLOCK | SOCK_CLOEXEC);
+	return type == SOCK_DGRAM || type == SOCK_SEQPACKET ? SocketKind::DATAGRAM : SocketKind::STREAM;
+}
+
+// A new socket can reuse the number of an fd whose close we didn't see, like one fclose closed
+static void remember_socket_kind(int fd, int type) {
+	if (fd >= 0 && fd < MAX_METRICS_FDS) socket_kinds[fd] = kind_of_type(type);
+}
+
+/**
+	Whether `fd` is a datagram socket. The cached kind is used unless `fresh`, and an fd that isn't
+	open yet is not remembered.
+*/
+static bool query_datagram(int fd, bool fresh = false) {
+	bool cached = fd >= 0 && fd < MAX_METRICS_FDS;
+	if (cached && !fresh) {
+		SocketKind kind = socket_kinds[fd].load(std::memory_order_relaxed);
+		if (kind != SocketKind::UNKNOWN) return kind == SocketKind::DATAGRAM;
+	}
+
+	int type;
+	socklen_t len = sizeof(type);
+	SocketKind kind;
+	if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) == 0) {
+		kind = kind_of_type(type);
+	} else if (errno == ENOTSOCK) {
+		kind = SocketKind::NOT_SOCKET;
+	} else {
+		return false;
+	}
+	if (cached) socket_kinds[fd] = kind;
+	return kind == SocketKind::DATAGRAM;
+}
+
+static bool is_datagram(int fd) {
+	return fd >= 0 && fd < MAX_METRICS_FDS && socket_kinds[fd].load(std::memory_order_relaxed) == SocketKind::DATAGRAM;
+}
+
+/**
+	Starts tracking `fd` as a framed socket with its own packet queue. An fd that is already tracked
+	keeps its queue and any frame it is partway through decoding.
+*/
+void track_fd(int fd) {
+	if (get_packet_queue(fd)) return;
+	bool datagram = query_datagram(fd, true);
+	// Stream framing would split datagrams, so ones we can't mark are left alone
+	if (datagram && (fd < 0 || fd >= MAX_METRICS_FDS)) return;
+	fds.emplace_back(fd, new PacketQueue());
+	if (!datagram) frame_decoders[fd] = FrameDecoder{};
+
+	if (coalesce_ns && !datagram && fd >= 0 && fd < MAX_METRICS_FDS) {
+		Coalescer* c = coalescers[fd].load();
+		if (!c) {
+			c = new Coalescer();
+			coalescers[fd] = c;
+		}
+		struct stat st;
+		c->socket = fstat(fd, &st) == 0 && S_ISSOCK(st.st_mode);
+		c->error = 0;
+	}
+
+	FdMetrics* fm = get_fd_metrics(fd);
+	if (fm) {
+		fm->queue_depth = 0;
+		fm->packets = 0;
+		fm->held_ns = 0;
+		fm->credited_ns = 0;
+		fm->tracked = true;
+	}
+
+	if (record_histograms && fd >= 0 && fd < MAX_METRICS_FDS) {
+		ConnectionHistograms* ch = nullptr;
+		while (retire_lock.test_and_set(std::memory_order_acquire));
+		if (!free_connections.empty()) {
+			ch = free_connections.back();
+			free_connections.pop_back();
+		}
+		retire_lock.clear(std::memory_order_release);
+		if (!ch) {
+			ch = new ConnectionHistograms();
+			ch->next = all_connections.load();
+			while (!all_connections.compare_exchange_weak(ch->next, ch));
+		}
+		ch->fd = fd;
+		connection_histograms[fd] = ch;
+	}
+}
+
+// Called when `fd` closes. Its histograms stay in the dump until too many newer ones have closed.
+static void retire_connection_histograms(int fd) {
+	ConnectionHistograms* ch = connection_histograms[fd].exchange(nullptr);
+	if (!ch) return;
+
+	while (retire_lock.test_and_set(std::memory_order_acquire));
+	retired_connections.push_back(ch);
+	if (retired_connections.size() > MAX_RETIRED_CONNECTIONS) {
+		ConnectionHistograms* oldest = retired_connections.front();
+		retired_connections.pop_front();
+		retired_histograms.hold_ns.merge(oldest->hold_ns);
+		retired_histograms.interarrival_ns.merge(oldest->interarrival_ns);
+		retired_histograms.payload_bytes.merge(oldest->payload_bytes);
+		// Cleared histograms dump nothing, so a free one can stay in all_connections
+		oldest->hold_ns.clear();
+		oldest->interarrival_ns.clear();
+		oldest->payload_bytes.clear();
+		oldest->last_arrival = 0;
+		oldest->peer[0] = '\0';
+		free_connections.push_back(oldest);
+	}
+	retire_lock.clear(std::memory_order_release);
+}
+
+bool has_buffered_input() {
+	for (const auto &entry : fds) {
+		if (entry.second->get_size() > 0) return true;
+	}
+	for (const auto &entry : frame_decoders) {
+		if (entry.second.header_len > 0 || entry.second.partial.buffer) return true;
+	}
+	return false;
+}
+
+bool list_inherited_fds(char* out, size_t len) {
+	size_t used = 0;
+	for (const auto &entry : fds) {
+		int flags = fcntl(entry.first, F_GETFD);
+		if (flags == -1 || (flags & FD_CLOEXEC)) continue;
+		int n = snprintf(out + used, len - used, used ? ",%d" : "%d", entry.first);
+		if (n < 0 || used + n >= len) return false;
+		used += n;
+	}
+	return used > 0;
+}
+
+void track_inherited_fds(const char* list) {
+	while (*list) {
+		char* end;
+		long fd = strtol(list, &end, 10);
+		if (end == list) break;
+		if (fcntl(fd, F_GETFD) != -1 && !get_packet_queue(fd)) track_fd(fd);
+		list = *end == ',' ? end + 1 : end;
+	}
+}
+
+static ConnectionHistograms* get_connection_histograms(int fd) {
+	if (!record_histograms || fd < 0 || fd >= MAX_METRICS_FDS) return nullptr;
+	return connection_histograms[fd].load(std::memory_order_relaxed);
+}
+
+// Renders the peer as address:port, so connections can be told apart after their fds are reused
+static void describe_peer(int fd, char* out, size_t len) {
+	sockaddr_storage addr;
+	socklen_t addr_len = sizeof(addr);
+	char host[INET6_ADDRSTRLEN] = "";
+	if (getpeername(fd, (sockaddr*)&addr, &addr_len) != 0) {
+		snprintf(out, len, errno == ENOTSOCK ? "pipe" : "unknown");
+	} else if (addr.ss_family == AF_INET) {
+		sockaddr_in* in = (sockaddr_in*)&addr;
+		inet_ntop(AF_INET, &in->sin_addr, host, sizeof(host));
+		snprintf(out, len, "%s:%u", host, ntohs(in->sin_port));
+	} else if (addr.ss_family == AF_INET6) {
+		sockaddr_in6* in6 = (sockaddr_in6*)&addr;
+		inet_ntop(AF_INET6, &in6->sin6_addr, host, sizeof(host));
+		snprintf(out, len, "[%s]:%u", host, ntohs(in6->sin6_port));
+	} else {
+		snprintf(out, len, "unix");
+	}
+}
+
+static void record_arrival(int fd, const Packet &packet) {
+	ConnectionHistograms* ch = get_connection_histograms(fd);
+	if (!ch) return;
+	if (ch->peer[0] == '\0') describe_peer(fd, ch->peer, sizeof(ch->peer));
+
+	for (ConnectionHistograms* h : { ch, &total_histograms }) {
+		if (h->last_arrival != 0) h->interarrival_ns.record(packet.arrival_time - h->last_arrival);
+		h->last_arrival = packet.arrival_time;
+		h->payload_bytes.record(packet.len);
+	}
+}
+
+static void record_delivery(int fd, const Packet &packet) {
+	ConnectionHistograms* ch = get_connection_histograms(fd);
+	if (!ch) return;
+	ch->hold_ns.record(packet.wakeup_time - packet.arrival_time);
+	total_histograms.hold_ns.record(packet.wakeup_time - packet.arrival_time);
+}
+
+/**
+	Appends `line` to `buf`, flushing to `fd` first when it doesn't fit. Returns false if a write
+	failed.
+*/
+static bool append_line(int fd, char* buf, size_t &len, size_t cap, const char* line, size_t n) {
+	if (len + n > cap) {
+		if (write(fd, buf, len) != (ssize_t)len) return false;
+		len = 0;
+	}
+	if (n > cap) return true;
+	memcpy(buf + len, line, n);
+	len += n;
+	return true;
+}
+
+static bool dump_histograms(int fd, char* buf, size_t &len, size_t cap, const ConnectionHistograms* h) {
+	const std::pair<const char*, const LogHistogram*> metrics[] = {
+		{ "hold_ns", &h->hold_ns }, { "interarrival_ns", &h->interarrival_ns }, { "payload_bytes", &h->payload_bytes },
+	};
+	for (const auto &metric : metrics) {
+		for (size_t i = 0; i < LogHistogram::BUCKETS; i++) {
+			uint64_t count = metric.second->get_count(i);
+			if (count == 0) continue;
+
+			char line[256];
+			int n = snprintf(line, sizeof(line), "%d,%d,%s,%s,%llu,%llu,%llu\n", getpid(), h->fd,
+				h->peer[0] ? h->peer : "unknown", metric.first, (unsigned long long)LogHistogram::lower_bound(i),
+				(unsigned long long)LogHistogram::upper_bound(i), (unsigned long long)count);
+			if (n < 0 || n >= (int)sizeof(line)) continue;
+			if (!append_line(fd, buf, len, cap, line, n)) return false;
+		}
+	}
+	return true;
+}
+
+/**
+	Appends `pid,fd,peer,metric,lower,upper,count` for every non-empty bucket. The totals over
+	all connections have fd -1 and peer "all", and closed connections past the most recent
+	MAX_RETIRED_CONNECTIONS are summed under peer "retired". Only uses syscalls and snprintf, so it can run
+	during shutdown from a signal handler.
+*/
+bool dump_connection_histograms(const char* path) {
+	int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (fd == -1) return false;
+	flock(fd, LOCK_EX);
+
+	char buf[4096];
+	size_t len = 0;
+	total_histograms.fd = -1;
+	snprintf(total_histograms.peer, sizeof(total_histograms.peer), "all");
+	bool ok = dump_histograms(fd, buf, len, sizeof(buf), &total_histograms);
+	retired_histograms.fd = -1;
+	snprintf(retired_histograms.peer, sizeof(retired_histograms.peer), "retired");
+	if (ok) ok = dump_histograms(fd, buf, len, sizeof(buf), &retired_histograms);
+	for (ConnectionHistograms* ch = all_connections.load(); ch && ok; ch = ch->next) {
+		ok = dump_histograms(fd, buf, len, sizeof(buf), ch);
+	}
+	if (ok && len > 0) ok = write(fd, buf, len) == (ssize_t)len;
+
+	flock(fd, LOCK_UN);
+	close(fd);
+	return ok;
+}
+
+void reset_connection_histograms() {
+	for (ConnectionHistograms* h = all_connections.load(); h; h = h->next) {
+		h->hold_ns.clear();
+		h->interarrival_ns.clear();
+		h->payload_bytes.clear();
+	}
+	total_histograms.hold_ns.clear();
+	total_histograms.interarrival_ns.clear();
+	total_histograms.payload_bytes.clear();
+	retired_histograms.hold_ns.clear();
+	retired_histograms.interarrival_ns.clear();
+	retired_histograms.payload_bytes.clear();
+}
+
 bool initialized = false;
 void initialize_real_functions() {
 	if (initialized) return;
@@ -65,8 +433,21 @@ void initialize_real_functions() {
 	real_connect = (connect_t)dlsym(RTLD_NEXT, "connect");
 	real_accept = (accept_t)dlsym(RTLD_NEXT, "accept");
 	real_accept4 = (accept4_t)dlsym(RTLD_NEXT, "accept4");
+	real_pipe = (pipe_t)dlsym(RTLD_NEXT, "pipe");
+	real_pipe2 = (pipe2_t)dlsym(RTLD_NEXT, "pipe2");
+	real_socketpair = (socketpair_t)dlsym(RTLD_NEXT, "socketpair");
+	real_sendto = (sendto_t)dlsym(RTLD_NEXT, "sendto");
+	real_sendmsg = (sendmsg_t)dlsym(RTLD_NEXT, "sendmsg");
+	real_sendmmsg = (sendmmsg_t)dlsym(RTLD_NEXT, "sendmmsg");
+	real_recvfrom = (recvfrom_t)dlsym(RTLD_NEXT, "recvfrom");
+	real_recvmsg = (recvmsg_t)dlsym(RTLD_NEXT, "recvmsg");
+	real_recvmmsg = (recvmmsg_t)dlsym(RTLD_NEXT, "recvmmsg");
+	real_shutdown = (shutdown_t)dlsym(RTLD_NEXT, "shutdown");
+	real_socket = (socket_t)dlsym(RTLD_NEXT, "socket");
 
-	if (!real_read || !real_write || !real_epoll_pwait || !real_close || !real_connect || !real_accept || !real_accept4) {
+	if (!real_read || !real_write || !real_epoll_pwait || !real_close || !real_connect || !real_accept || !real_accept4 ||
+		!real_pipe || !real_pipe2 || !real_socketpair || !real_sendto || !real_sendmsg || !real_sendmmsg ||
+		!real_recvfrom || !real_recvmsg || !real_recvmmsg || !real_shutdown || !real_socket) {
 		// Critical error: failed to get real function pointers.
 		// This usually means LD_PRELOAD is not set up correctly or the functions don't exist.
 		std::cerr << "Socket_Hook: CRITICAL - Failed to dlsym real functions. Exiting." << std::endl;
@@ -76,141 +457,316 @@ void initialize_real_functions() {
 }
 
 /**
-	Issue a blocking read to `fd`. Reads in a packet, then parses the metadata and adds it to
-	the given packet queue with the associated delay time.
+	When a packet that arrived at `arrival` carrying `meta` may be delivered.
 */
-ssize_t read_to_queue(int fd, PacketQueue* pq) {
-	MemoryPoolBuffer *mp_buf = mp.get_buf();
-	if (!mp_buf) {
-		throw std::bad_alloc();
+static time_ns packet_wakeup(int fd, const PacketMetadata &meta, time_ns arrival) {
+	// Delay:
+	//		Pos: How much "virtual time" we should account for based on this server.
+	//		Neg: How much "virtual time" we should account for based on remote server.
+	long long packet_delay = p.get_hit_counts() * delay_length_ns + delayed_ns;
+	packet_delay -= meta.number_server_calls * delay_length_ns + meta.total_virtual_delay;
+
+	FdMetrics* fm = get_fd_metrics(fd);
+	if (packet_delay < 0) {
+		long long blocking_time = arrival - last_blocking_time;
+		long long credit = std::min(-packet_delay, blocking_time);
+		delayed_ns += credit;
+		if (fm && credit > 0) fm->credited_ns += credit;
+		return arrival;
 	}
-	char* read_buf = mp_buf->buffer;
-	ssize_t n = real_read(fd, read_buf, PACKET_SIZE);
-	if (n <= 0) {
-		mp.return_buf(mp_buf);
-		return n;
+	if (fm) fm->held_ns += packet_delay;
+	return arrival + packet_delay;
+}
+
+// Datagrams are sized to fit and owned by their packet, stream packets come from the pool
+static void release_packet(int fd, const Packet &packet) {
+	if (is_datagram(fd)) {
+		delete packet.buffer;
+	} else {
+		mp.return_buf(packet.buffer);
 	}
+}
 
-	// Default if there is no metadata
-	timespec wakeup_time;
-	clock_gettime(CLOCK_MONOTONIC, &wakeup_time);
+// Queues one received datagram whole, with its source in front of the payload
+static void queue_datagram(int fd, PacketQueue* pq, const char* data, size_t n, const DatagramSource &source, time_ns arrival) {
+	Packet entry { .buffer = nullptr, .len = n, .nread = 0, .arrival_time = arrival, .wakeup_time = arrival };
+	size_t packet_magic = 0;
+	if (n >= HEADER_SIZE) memcpy(&packet_magic, data, sizeof(MAGIC));
+	if (packet_magic == MAGIC) {
+		PacketMetadata meta;
+		memcpy(&meta, data + sizeof(MAGIC), sizeof(PacketMetadata));
+		entry.wakeup_time = packet_wakeup(fd, meta, arrival);
+		data += HEADER_SIZE;
+		entry.len = n - HEADER_SIZE;
+	}
 
-	// We can have multiple packets in a read or broken up across multiple reads
-	size_t nconsumed = 0;
-	Packet entry { .buffer = mp.get_buf(), .len = 0, .nread = 0, .wakeup_time = wakeup_time };
-	while(nconsumed < n) {
-		if (entry.len == 0) {
-			// Read MAGIC and metadata
-			size_t packet_magic = 0;
-			memcpy(&packet_magic, read_buf + nconsumed, sizeof(MAGIC));
-			if (packet_magic != MAGIC) {
-				// If no header, just treat rest of data as packet
-				entry.len = n - nconsumed;
-			} else {
-				PacketMetadata meta;
-				memcpy(&meta, read_buf + nconsumed + sizeof(MAGIC), sizeof(PacketMetadata));
-
-				// Delay:
-				//		Pos: How much "virtual time" we should account for based on this server.
-				//		Neg: How much "virtual time" we should account for based on remote server.
-				long long packet_delay = p.get_hit_counts() * delay_length_ns + delayed_ns;
-				packet_delay -= meta.number_server_calls * delay_length_ns + meta.total_virtual_delay;
-
-				if (packet_delay < 0) {
-					long long blocking_time = 1e9 * (wakeup_time.tv_sec - last_blocking_time.tv_sec)
-						+ (wakeup_time.tv_nsec - last_blocking_time.tv_nsec);
-					delayed_ns += std::min(-packet_delay, blocking_time);
-				} else {
-					add_ns(&entry.wakeup_time, packet_delay);
-				}
+	entry.buffer = new MemoryPoolBuffer(sizeof(DatagramSource) + entry.len);
+	memcpy(entry.buffer->buffer, &source, sizeof(DatagramSource));
+	memcpy(entry.buffer->buffer + sizeof(DatagramSource), data, entry.len);
+	record_arrival(fd, entry);
+	pq->push(entry);
+}
+
+/**
+	Receives every datagram waiting on `fd`, up to DATAGRAM_BATCH, with one recvmmsg, and queues
+	each whole with its own wakeup time. Blocks for the first one unless `flags` say otherwise.
+	Returns the number of bytes received, headers included, or the recvmmsg error.
+*/
+static ssize_t read_datagrams_to_queue(int fd, PacketQueue* pq, int flags) {
+	if (datagram_batch.empty()) datagram_batch.resize(DATAGRAM_BATCH * MAX_DATAGRAM);
+	unsigned int batch = std::min<size_t>(DATAGRAM_BATCH, pq->get_capacity() - pq->get_size());
 
-				// Set packet len
-				entry.len = meta.data_size;
-				nconsumed += sizeof(MAGIC) + sizeof(PacketMetadata);
+	struct mmsghdr msgs[DATAGRAM_BATCH];
+	struct iovec iovs[DATAGRAM_BATCH];
+	DatagramSource sources[DATAGRAM_BATCH];
+	memset(msgs, 0, sizeof(msgs));
+	for (unsigned int i = 0; i < batch; i++) {
+		iovs[i] = { datagram_batch.data() + i * MAX_DATAGRAM, MAX_DATAGRAM };
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = &sources[i].addr;
+		msgs[i].msg_hdr.msg_namelen = sizeof(sources[i].addr);
+	}
+
+	int n = real_recvmmsg(fd, msgs, batch, flags | MSG_WAITFORONE, nullptr);
+	if (n < 0) return n;
+	uint64_t overhead_start = overhead_begin();
+
+	time_ns arrival = now_ns();
+	ssize_t nbytes = 0;
+	for (int i = 0; i < n; i++) {
+		sources[i].len = msgs[i].msg_hdr.msg_namelen;
+		queue_datagram(fd, pq, (const char*)iovs[i].iov_base, msgs[i].msg_len, sources[i], arrival);
+		nbytes += msgs[i].msg_len;
+	}
+	FdMetrics* fm = get_fd_metrics(fd);
+	if (fm) {
+		fm->packets += n;
+		fm->queue_depth = pq->get_size();
+	}
+	overhead_end(overhead_start);
+	return nbytes;
+}
+
+// Pushes a packet that has been read in completely
+static void queue_packet(int fd, PacketQueue* pq, Packet &entry) {
+	entry.nread = 0;
+	record_arrival(fd, entry);
+	pq->push(entry);
+	FdMetrics* fm = get_fd_metrics(fd);
+	if (fm) fm->packets++;
+}
+
+// Data that came without a header, queued as is in packets of up to PACKET_SIZE
+static void queue_unframed(int fd, PacketQueue* pq, const char* data, size_t n, time_ns arrival) {
+	while (n > 0) {
+		Packet entry { .buffer = mp.get_buf(), .len = std::min(n, PACKET_SIZE), .nread = 0, .arrival_time = arrival, .wakeup_time = arrival };
+		memcpy(entry.buffer->buffer, data, entry.len);
+		queue_packet(fd, pq, entry);
+		data += entry.len;
+		n -= entry.len;
+	}
+}
+
+/**
+	Decodes `n` bytes read from a stream into packets, carrying a header or packet that is cut off
+	by the end of the read over to the next one in `dec`.
+*/
+static void decode_stream(int fd, PacketQueue* pq, FrameDecoder &dec, const char* data, size_t n, time_ns arrival) {
+	size_t i = 0;
+	while (i < n) {
+		if (!dec.partial.buffer) {
+			// Between packets: gather the next header, which can itself be split across reads
+			size_t take = std::min(HEADER_SIZE - dec.header_len, n - i);
+			memcpy(dec.header + dec.header_len, data + i, take);
+			size_t have = dec.header_len + take;
+			PacketMetadata meta;
+			memcpy(&meta, dec.header + sizeof(MAGIC), sizeof(PacketMetadata));
+			if (memcmp(dec.header, &MAGIC, std::min(have, sizeof(MAGIC))) != 0 ||
+				(have == HEADER_SIZE && meta.data_size > PACKET_SIZE)) {
+				// If no header, just treat rest of data as packet
+				queue_unframed(fd, pq, dec.header, dec.header_len, arrival);
+				queue_unframed(fd, pq, data + i, n - i, arrival);
+				dec.header_len = 0;
+				return;
 			}
+			i += take;
+			dec.header_len = have;
+			if (have < HEADER_SIZE) return;
+
+			dec.header_len = 0;
+			dec.partial = Packet{ .buffer = mp.get_buf(), .len = meta.data_size, .nread = 0, .arrival_time = arrival, .wakeup_time = 0 };
+			dec.partial.wakeup_time = packet_wakeup(fd, meta, arrival);
 		}
 
-		// Copy remaining bytes into entry
-		size_t to_copy = std::min(entry.len - entry.nread, n - nconsumed);
-		memcpy(entry.buffer->buffer, read_buf + nconsumed, to_copy);
-		nconsumed += to_copy;
-		entry.nread += to_copy;
+		// Copy remaining bytes into the packet
+		size_t to_copy = std::min(dec.partial.len - dec.partial.nread, n - i);
+		memcpy(dec.partial.buffer->buffer + dec.partial.nread, data + i, to_copy);
+		i += to_copy;
+		dec.partial.nread += to_copy;
 
 		// Packet fully copied
-		if (entry.len == entry.nread) {
-			entry.nread = 0;
-			pq->push(entry);
-			// If there is another packet
-			if (nconsumed < n) entry = Packet{ .buffer = mp.get_buf(), .len = 0, .nread = 0, .wakeup_time = wakeup_time };
-		} else {
-			// Nead to make another read
-			n = real_read(fd, read_buf, PACKET_SIZE);
-			if (n <= 0) {
-				mp.return_buf(mp_buf);
-				mp.return_buf(entry.buffer);
-				return n;
-			}
-			nconsumed = 0;
+		if (dec.partial.nread == dec.partial.len) {
+			queue_packet(fd, pq, dec.partial);
+			dec.partial.buffer = nullptr;
 		}
 	}
+}
+
+/**
+	Issue a blocking read to `fd`, taking in as much as is available in one call, then decode every
+	packet in it and add them to the given packet queue with their delay times. A stream read is
+	capped at a header's worth of bytes per free queue slot, 20,460 bytes into an empty queue. A
+	packet cut off at the end of the read waits in the fd's decoder for the next one, so this can
+	return having queued nothing. The reads themselves are the application's, so only the parsing
+	counts as overhead. `flags` are recv flags for the read, e.g. MSG_DONTWAIT.
+*/
+ssize_t read_to_queue(int fd, PacketQueue* pq, int flags = 0) {
+	size_t room = pq->get_capacity() - pq->get_size();
+	if (room == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+	if (is_datagram(fd)) return read_datagrams_to_queue(fd, pq, flags);
+
+	// Every packet takes at least a header, so this many bytes can't overflow the queue
+	size_t len = std::min(MAX_DATAGRAM, std::max<size_t>(room, 2) * HEADER_SIZE - HEADER_SIZE);
+	char* read_buf = io_buf;
+	ssize_t n = flags ? real_recvfrom(fd, read_buf, len, flags, nullptr, nullptr) : real_read(fd, read_buf, len);
+	if (n <= 0) {
+		if (n == 0) record_read(fd, read_buf, n);
+		return n;
+	}
+	uint64_t overhead_start = overhead_begin();
+	record_read(fd, read_buf, n);
+
+	FrameDecoder* dec = get_frame_decoder(fd);
+	if (dec) {
+		decode_stream(fd, pq, *dec, read_buf, n, now_ns());
+	} else {
+		queue_unframed(fd, pq, read_buf, n, now_ns());
+	}
+	FdMetrics* fm = get_fd_metrics(fd);
+	if (fm) fm->queue_depth = pq->get_size();
+	overhead_end(overhead_start);
 	return n;
 }
 
+/**
+	Hands the application the head of `fd`'s queue into `iov` once its wakeup time comes, reading
+	a packet in first if none is queued. A stream packet is delivered across as many calls as it
+	takes, a datagram in one, dropping whatever doesn't fit like the kernel does. Takes the recv
+	flags MSG_DONTWAIT, MSG_PEEK and MSG_TRUNC, and hands back a datagram's source in `addr`.
+*/
+static ssize_t deliver(int fd, PacketQueue* pq, const struct iovec* iov, size_t iovlen, int flags,
+	struct sockaddr* addr, socklen_t* addrlen, int* msg_flags) {
+	bool datagram = is_datagram(fd);
+
+	// If wait queue is currently empty, do a blocking read for a new packet. A read can end
+	// partway through one, leaving nothing to deliver yet, so keep reading until it is in.
+	while (pq->get_size() == 0) {
+		// The peer may be waiting on what we've buffered before it replies. A buffer another thread
+		// holds is already being sent, and that thread may be blocked on this very read.
+		flush_output(false);
+		last_blocking_time = now_ns();
+		uint64_t global_at_block = pre_block();
+		ssize_t ret = read_to_queue(fd, pq, flags & MSG_DONTWAIT);
+		post_block(global_at_block);
+		// An empty datagram is still a datagram, but an empty stream read is the end of it
+		if (ret < 0 || (ret == 0 && !datagram)) return ret;
+	}
+	// Now, we're guaranteed wait queue has at least one element
+
+	// Now process packet in wait queue
+	while (true) {
+		uint64_t overhead_start = overhead_begin();
+		Packet* head = pq->get_head();
+
+		// Deliver if ready
+		if (head->wakeup_time <= now_ns()) {
+			const char* data = head->buffer->buffer + (datagram ? sizeof(DatagramSource) : 0) + head->nread;
+			size_t avail = head->len - head->nread;
+			size_t copied = 0;
+			for (size_t i = 0; i < iovlen && copied < avail; i++) {
+				size_t to_copy = std::min(avail - copied, iov[i].iov_len);
+				memcpy(iov[i].iov_base, data + copied, to_copy);
+				copied += to_copy;
+			}
+
+			if (datagram) {
+				DatagramSource* source = (DatagramSource*)head->buffer->buffer;
+				if (addr && addrlen) {
+					memcpy(addr, &source->addr, std::min(*addrlen, source->len));
+					*addrlen = source->len;
+				}
+				if (msg_flags && copied < avail) *msg_flags |= MSG_TRUNC;
+			}
+			ssize_t ret = datagram && (flags & MSG_TRUNC) ? avail : copied;
+
+			if (!(flags & MSG_PEEK)) {
+				head->nread = datagram ? head->len : head->nread + copied;
+				if (head->nread == head->len) {
+					record_delivery(fd, *head);
+					release_packet(fd, *head);
+					pq->pop();
+					FdMetrics* fm = get_fd_metrics(fd);
+					if (fm) fm->queue_depth = pq->get_size();
+				}
+			}
+			overhead_end(overhead_start);
+			return ret;
+		}
+
+		// Not there yet in virtual time, which a non-blocking receive can't wait for
+		overhead_end(overhead_start);
+		if (flags & MSG_DONTWAIT) {
+			errno = EAGAIN;
+			return -1;
+		}
+
+		// Otherwise wait for timeout
+		flush_output(false);
+		uint64_t global_at_block = pre_block();
+		sleep_until(head->wakeup_time);
+		post_block(global_at_block);
+		// Timeout: packet head is now ready, loop again to process
+	}
+}
+
 extern "C" ssize_t read(int fd, void *buf, size_t count) {
 	initialize_real_functions();
 
     // Passthrough for non-socket fds
 	PacketQueue* pq = get_packet_queue(fd);
     if (!pq) {
-        return real_read(fd, buf, count);
-    }
-
-	// If wait queue is currently empty, do a blocking read for a new packet
-	if (pq->get_size() == 0) {
-		clock_gettime(CLOCK_MONOTONIC, &last_blocking_time);
-		ssize_t ret = read_to_queue(fd, pq);
-		if (ret <= 0) return ret;
-	}
-	// Now, we're guaranteed wait queue has at least one element
+		if (!is_eventfd(fd)) return real_read(fd, buf, count);
 
-	// Now process packet in wait queue
-	timespec now;
-    while (true) {
-        Packet* head = pq->get_head();
-    	clock_gettime(CLOCK_MONOTONIC, &now);
-
-        // Deliver if ready
-        if (time_passed(head->wakeup_time, now)) {
-            size_t avail = head->len - head->nread;
-            size_t to_copy = std::min(avail, count);
-            memcpy(buf, head->buffer->buffer + head->nread, to_copy);
-            head->nread += to_copy;
-            if (head->nread == head->len) {
-				mp.return_buf(head->buffer);
-                pq->pop();
-            }
-            return to_copy;
-        }
-
-        // Otherwise wait for timeout
-        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &head->wakeup_time, nullptr);
-        // Timeout: packet head is now ready, loop again to process
+		// Another thread's write woke us, so take its delay credit
+		pre_block();
+		ssize_t ret = real_read(fd, buf, count);
+		if (ret > 0) post_wake(eventfd_key(fd));
+		return ret;
     }
+
+	struct iovec iov = { buf, count };
+	return deliver(fd, pq, &iov, 1, 0, nullptr, nullptr, nullptr);
 }
 
 extern "C" int epoll_pwait(int epfd, struct epoll_event events[], int maxevents, int timeout, const sigset_t* sigmask) {
 	initialize_real_functions();
+	if (fork_point_requested) dcuz_fork_point();
+	if (!signal_depth) p.refresh_modules_if_changed();
 	int nfds = 0;
 
 	// Track time spent, so we eventually timeout if we need to retry multiple times
-	timespec start_time;
+	uint64_t overhead_start = overhead_begin();
+	time_ns start_time = now_ns();
 	int time_spent = 0;
-	clock_gettime(CLOCK_MONOTONIC, &start_time);
 
 	// First see if we have any queued fds that are ready
 	for (int i = 0; i < fds.size(); i++) {
 		PacketQueue* pq = fds[i].second;
-		if (pq->get_size() > 0 && time_passed(pq->get_head()->wakeup_time, start_time)) {
+		if (pq->get_size() > 0 && pq->get_head()->wakeup_time <= start_time) {
 			events[nfds].events = EPOLLIN;
 			events[nfds].data.fd = fds[i].first;
 			events[nfds].data.u32 = events[nfds].data.u64 = uint32_t(fds[i].first);
@@ -219,14 +775,21 @@ extern "C" int epoll_pwait(int epfd, struct epoll_event events[], int maxevents,
 	}
 
 	while(nfds == 0 && (timeout == -1 || (timeout != -1 && timeout > time_spent))) {
-		clock_gettime(CLOCK_MONOTONIC, &last_blocking_time);
+		overhead_end(overhead_start);
+		flush_output(false);
+		last_blocking_time = now_ns();
+		uint64_t global_at_block = pre_block();
 		nfds = real_epoll_pwait(epfd, events, maxevents, timeout - time_spent, sigmask);
+		post_block(global_at_block);
+		overhead_start = overhead_begin();
 
-		timespec end_time;
-		clock_gettime(CLOCK_MONOTONIC, &end_time);
+		time_ns end_time = now_ns();
 
 		// If epoll naturally times out or fails, return
-		if (nfds <= 0) return nfds;
+		if (nfds <= 0) {
+			overhead_end(overhead_start);
+			return nfds;
+		}
 
 		// For each fd, check if we are actually read to return
 		// Even if an fd has something in its queue, we still read to ensure that it doesn't trigger epoll again
@@ -242,10 +805,15 @@ extern "C" int epoll_pwait(int epfd, struct epoll_event events[], int maxevents,
 					continue;
 				}
 
+				// read_to_queue times its own parsing
+				overhead_end(overhead_start);
 				read_to_queue(fd, pq);
+				overhead_start = overhead_begin();
+				// Packets without delay wake up at the time they were read, which is after end_time
+				end_time = now_ns();
 
 				// Is head of queue ready?
-				if (pq->get_size() > 0 && time_passed(pq->get_head()->wakeup_time, end_time)) {
+				if (pq->get_size() > 0 && pq->get_head()->wakeup_time <= end_time) {
 					curr++;
 				} else {
 					std::swap(events[curr], events[end]);
@@ -258,15 +826,14 @@ extern "C" int epoll_pwait(int epfd, struct epoll_event events[], int maxevents,
 
 		nfds = end + 1;
 		if (timeout != -1) {
-			timespec diff = time_diff(end_time, start_time);
-			time_spent = diff.tv_sec * 1000 + diff.tv_nsec / 1e6;
+			time_spent = (end_time - start_time) / 1000000;
 		}
 
 		// Add fds that should also be awake but we previously read
 		// NOTE: This is technically not correct since we don't know that all fds are tied to this event fd.
 		for (int i = 0; i < fds.size(); i++) {
 			PacketQueue* pq = fds[i].second;
-			if (pq->get_size() > 0 && time_passed(pq->get_head()->wakeup_time, end_time)) {
+			if (pq->get_size() > 0 && pq->get_head()->wakeup_time <= end_time) {
 				events[nfds].events = EPOLLIN;
 				events[nfds].data.fd = fds[i].first;
 				events[nfds].data.u32 = events[nfds].data.u64 = uint32_t(fds[i].first);
@@ -275,46 +842,502 @@ extern "C" int epoll_pwait(int epfd, struct epoll_event events[], int maxevents,
 		}
 	}
 
+	overhead_end(overhead_start);
 	return nfds;
 }
 
+// Writes MAGIC and our metadata for `data_size` bytes of payload to the start of `out`
+static void write_header(char* out, size_t data_size) {
+	PacketMetadata meta {
+		.number_server_calls = p.get_hit_counts(),
+		.total_virtual_delay = delayed_ns,
+		.data_size = uint32_t(data_size)
+	};
+	memcpy(out, &MAGIC, sizeof(MAGIC));
+	memcpy(out + sizeof(MAGIC), &meta, sizeof(PacketMetadata));
+}
+
+// Send flags a buffered write can honor. Any other goes out on its own, after what is buffered.
+constexpr int COALESCE_FLAGS = MSG_MORE | MSG_NOSIGNAL | MSG_DONTWAIT;
+
+/*
+	The holder may be blocked sending to a full socket, so after a few tries this sleeps between
+	them instead of spinning a CPU. clock_nanosleep is async-signal-safe, like the rest of it.
+*/
+static void lock_coalescer(Coalescer* c) {
+	for (int tries = 0; c->lock.test_and_set(std::memory_order_acquire); tries++) {
+		if (tries < 16) {
+			sched_yield();
+		} else {
+			sleep_for(50000);
+		}
+	}
+}
+
+static Coalescer* get_coalescer(int fd) {
+	if (!coalesce_ns || fd < 0 || fd >= MAX_METRICS_FDS || is_datagram(fd)) return nullptr;
+	return coalescers[fd].load(std::memory_order_relaxed);
+}
+
+/**
+	Sends as much of `c`'s buffer as `fd` takes, keeping the rest for the next flush. `flags` are
+	send flags, MSG_MORE while the application is still writing and MSG_DONTWAIT off its thread.
+	Errors other than a full socket drop the buffer and are kept for the next write to report.
+*/
+static void flush_locked(int fd, Coalescer* c, int flags) {
+	if (c->len == 0) return;
+	size_t sent = 0;
+	while (sent < c->len) {
+		ssize_t n = c->socket ? real_sendto(fd, c->buf + sent, c->len - sent, flags | MSG_NOSIGNAL, nullptr, 0)
+			: real_write(fd, c->buf + sent, c->len - sent);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				c->error = errno;
+				sent = c->len;
+			}
+			break;
+		}
+		sent += n;
+	}
+	memmove(c->buf, c->buf + sent, c->len - sent);
+	c->len -= sent;
+	if (c->len == 0) set_pending(fd, false);
+}
+
+// How long a drain waits for a full fd to take anything more before dropping the rest
+constexpr int DRAIN_TIMEOUT_MS = 1000;
+
+/**
+	Sends all of `c`'s buffer, for when it is about to be lost. A non-blocking fd that is full is
+	waited on with poll, which is async-signal-safe, instead of dropping what it won't take yet.
+	The lock is let go while waiting, so other threads can still write to or flush the fd.
+*/
+static void drain_locked(int fd, Coalescer* c) {
+	flush_locked(fd, c, 0);
+	while (c->len > 0) {
+		c->lock.clear(std::memory_order_release);
+		struct pollfd pfd = { fd, POLLOUT, 0 };
+		int ready = poll(&pfd, 1, DRAIN_TIMEOUT_MS);
+		int poll_errno = errno;
+		lock_coalescer(c);
+		if (ready < 0 && poll_errno == EINTR) continue;
+		if (ready <= 0) break;
+		flush_locked(fd, c, 0);
+	}
+}
+
+static void flush_fd(int fd, Coalescer* c, bool drain = false) {
+	lock_coalescer(c);
+	if (drain) {
+		drain_locked(fd, c);
+	} else {
+		flush_locked(fd, c, 0);
+	}
+	c->lock.clear(std::memory_order_release);
+}
+
+static void flush_pending(bool wait, bool drain) {
+	int saved_errno = errno;
+	for (int word = 0; word < MAX_METRICS_FDS / 64; word++) {
+		uint64_t pending = pending_output[word].load(std::memory_order_relaxed);
+		while (pending) {
+			int fd = word * 64 + __builtin_ctzll(pending);
+			pending &= pending - 1;
+			Coalescer* c = coalescers[fd].load(std::memory_order_relaxed);
+			if (wait) {
+				lock_coalescer(c);
+			} else if (c->lock.test_and_set(std::memory_order_acquire)) {
+				continue;
+			}
+			if (drain) {
+				drain_locked(fd, c);
+			} else {
+				flush_locked(fd, c, 0);
+			}
+			c->lock.clear(std::memory_order_release);
+		}
+	}
+	errno = saved_errno;
+}
+
+void flush_output(bool wait) {
+	flush_pending(wait, false);
+}
+
+void drain_output(bool wait) {
+	flush_pending(wait, true);
+}
+
+// Sends buffers whose oldest frame has waited out the deadline, skipping any the application holds
+static void* flush_expired(void*) {
+	while (true) {
+		sleep_for(std::max<time_ns>(coalesce_ns / 2, 1000));
+		time_ns now = now_ns();
+		for (int word = 0; word < MAX_METRICS_FDS / 64; word++) {
+			uint64_t pending = pending_output[word].load(std::memory_order_relaxed);
+			while (pending) {
+				int fd = word * 64 + __builtin_ctzll(pending);
+				pending &= pending - 1;
+				Coalescer* c = coalescers[fd].load(std::memory_order_relaxed);
+				if (c->lock.test_and_set(std::memory_order_acquire)) continue;
+				if (c->len > 0 && c->first_write + coalesce_ns <= now) flush_locked(fd, c, MSG_DONTWAIT);
+				c->lock.clear(std::memory_order_release);
+			}
+		}
+	}
+	return nullptr;
+}
+
+static bool start_flush_thread() {
+	pthread_t thread;
+	if (pthread_create(&thread, nullptr, flush_expired, nullptr) != 0) {
+		std::cerr << "Failed to start coalescing thread" << std::endl;
+		return false;
+	}
+	pthread_detach(thread);
+	return true;
+}
+
+bool start_coalescing(uint64_t deadline_ns) {
+	coalesce_ns = deadline_ns;
+	if (start_flush_thread()) return true;
+	coalesce_ns = 0;
+	return false;
+}
+
+void reset_coalescing_after_fork() {
+	if (!coalesce_ns) return;
+	for (int fd = 0; fd < MAX_METRICS_FDS; fd++) {
+		Coalescer* c = coalescers[fd].load(std::memory_order_relaxed);
+		if (!c) continue;
+		c->len = 0;
+		c->lock.clear();
+	}
+	for (std::atomic<uint64_t> &word : pending_output) word = 0;
+	// Threads don't survive fork, so the child needs its own flusher
+	start_flush_thread();
+}
+
+/**
+	Frames `msg` into `fd`'s buffer instead of sending it, with a header carrying our metadata as
+	of now. Like a write, only what fits in one packet is taken. A full buffer is flushed first,
+	and a non-blocking socket that can't take it fails with EAGAIN.
+*/
+static ssize_t coalesce_sendmsg(int fd, Coalescer* c, const struct msghdr* msg, int flags) {
+	size_t total = 0;
+	for (size_t i = 0; i < msg->msg_iovlen; i++) total += msg->msg_iov[i].iov_len;
+	size_t payload = std::min(total, PACKET_SIZE - HEADER_SIZE);
+
+	lock_coalescer(c);
+	// More is coming, so let the kernel hold a partial segment for it
+	if (c->len + HEADER_SIZE + payload > COALESCE_BYTES) flush_locked(fd, c, (flags & MSG_DONTWAIT) | MSG_MORE);
+	if (c->error) {
+		errno = c->error;
+		c->error = 0;
+		c->lock.clear(std::memory_order_release);
+		return -1;
+	}
+	if (c->len + HEADER_SIZE + payload > COALESCE_BYTES) {
+		c->lock.clear(std::memory_order_release);
+		errno = EAGAIN;
+		return -1;
+	}
+
+	uint64_t overhead_start = overhead_begin();
+	char* out = c->buf + c->len;
+	size_t copied = 0;
+	for (size_t i = 0; i < msg->msg_iovlen && copied < payload; i++) {
+		size_t to_copy = std::min(payload - copied, msg->msg_iov[i].iov_len);
+		memcpy(out + HEADER_SIZE + copied, msg->msg_iov[i].iov_base, to_copy);
+		copied += to_copy;
+	}
+	write_header(out, payload);
+	if (c->len == 0) {
+		c->first_write = now_ns();
+		set_pending(fd, true);
+	}
+	c->len += HEADER_SIZE + payload;
+	overhead_end(overhead_start);
+	c->lock.clear(std::memory_order_release);
+	return payload;
+}
+
+// The fd list can't be searched from a signal handler, since the interrupted thread may be growing it
+static bool tracked_in_signal(int fd) {
+	return fd >= 0 && fd < MAX_METRICS_FDS && fd_metrics[fd].tracked.load(std::memory_order_relaxed);
+}
+
+/**
+	Frames a send made from a signal handler into one packet on the stack, and sends it at once with
+	write, or sendmsg for a socket. It goes out ahead of anything still buffered for the fd. A
+	datagram too big for one packet fails with EMSGSIZE, and a stream sends what fits.
+*/
+static ssize_t signal_sendmsg(int fd, const struct msghdr* msg, int flags, bool use_write) {
+	size_t total = 0;
+	for (size_t i = 0; i < msg->msg_iovlen; i++) total += msg->msg_iov[i].iov_len;
+	size_t payload = std::min(total, PACKET_SIZE - HEADER_SIZE);
+	if (is_datagram(fd) && payload < total) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	char out[PACKET_SIZE];
+	size_t copied = 0;
+	for (size_t i = 0; i < msg->msg_iovlen && copied < payload; i++) {
+		size_t to_copy = std::min(payload - copied, msg->msg_iov[i].iov_len);
+		memcpy(out + HEADER_SIZE + copied, msg->msg_iov[i].iov_base, to_copy);
+		copied += to_copy;
+	}
+	write_header(out, payload);
+
+	ssize_t ret;
+	if (use_write) {
+		ret = real_write(fd, out, HEADER_SIZE + payload);
+	} else {
+		struct iovec framed = { out, HEADER_SIZE + payload };
+		struct msghdr framed_msg = *msg;
+		framed_msg.msg_iov = &framed;
+		framed_msg.msg_iovlen = 1;
+		ret = real_sendmsg(fd, &framed_msg, flags);
+	}
+
+	// Hide metadata written
+	if (ret < 0) return ret;
+	return ret - HEADER_SIZE;
+}
+
+/**
+	Sends `msg` on a tracked socket as one framed packet. A datagram carries its own header and is
+	never split, so one too big to frame fails with EMSGSIZE. A stream sends what fits in one packet
+	and reports the rest unsent, like write.
+*/
+static ssize_t framed_sendmsg(int fd, const struct msghdr* msg, int flags) {
+	if (signal_depth) return signal_sendmsg(fd, msg, flags, false);
+
+	bool datagram = is_datagram(fd);
+	size_t total = 0;
+	for (size_t i = 0; i < msg->msg_iovlen; i++) total += msg->msg_iov[i].iov_len;
+	if (datagram && total + HEADER_SIZE > MAX_DATAGRAM) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	// The peer may be waiting on this, so pay our debt before it can go ahead
+	catch_up();
+
+	Coalescer* c = get_coalescer(fd);
+	if (c && !(flags & ~COALESCE_FLAGS)) return coalesce_sendmsg(fd, c, msg, flags);
+	if (c) flush_fd(fd, c);
+
+	uint64_t overhead_start = overhead_begin();
+	char stream_buf[PACKET_SIZE];
+	char* out = datagram ? io_buf : stream_buf;
+	size_t payload = std::min(total, (datagram ? MAX_DATAGRAM : PACKET_SIZE) - HEADER_SIZE);
+
+	size_t copied = 0;
+	for (size_t i = 0; i < msg->msg_iovlen && copied < payload; i++) {
+		size_t to_copy = std::min(payload - copied, msg->msg_iov[i].iov_len);
+		memcpy(out + HEADER_SIZE + copied, msg->msg_iov[i].iov_base, to_copy);
+		copied += to_copy;
+	}
+	write_header(out, payload);
+
+	struct iovec framed = { out, HEADER_SIZE + payload };
+	struct msghdr framed_msg = *msg;
+	framed_msg.msg_iov = &framed;
+	framed_msg.msg_iovlen = 1;
+	overhead_end(overhead_start);
+
+	ssize_t ret = real_sendmsg(fd, &framed_msg, flags);
+
+	// Hide metadata written
+	if (ret < 0) return ret;
+	return ret - HEADER_SIZE;
+}
+
 extern "C" ssize_t write(int fd, const void *buf, size_t count) {
 	initialize_real_functions();
 
+	if (signal_depth) {
+		if (!tracked_in_signal(fd)) return real_write(fd, buf, count);
+		struct iovec iov = { (void*)buf, count };
+		struct msghdr msg = {};
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		return signal_sendmsg(fd, &msg, 0, true);
+	}
+
 	// Passthrough for non-socket fds
 	PacketQueue* pq = get_packet_queue(fd);
 	if (!pq) {
+		if (is_eventfd(fd)) wake(eventfd_key(fd));
 		return real_write(fd, buf, count);
 	}
 
+	// A write on a datagram socket sends one datagram
+	if (is_datagram(fd)) {
+		struct iovec iov = { (void*)buf, count };
+		struct msghdr msg = {};
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		return framed_sendmsg(fd, &msg, 0);
+	}
+
+	// The peer may be waiting on this, so pay our debt before it can go ahead
+	catch_up();
+
+	Coalescer* c = get_coalescer(fd);
+	if (c) {
+		struct iovec iov = { (void*)buf, count };
+		struct msghdr msg = {};
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		return coalesce_sendmsg(fd, c, &msg, 0);
+	}
+
+	uint64_t overhead_start = overhead_begin();
 	char new_buf[PACKET_SIZE];
 
-	// Copy over metadata before buf
-	PacketMetadata meta {
-		.number_server_calls = p.get_hit_counts(),
-		.total_virtual_delay = delayed_ns,
-		.data_size = uint32_t(count)
-	};
-	memcpy(new_buf, &MAGIC, sizeof(MAGIC));
-	memcpy(new_buf + sizeof(MAGIC), &meta, sizeof(PacketMetadata));
+	// Only what fits in one packet is sent, so that's the size the reader should expect
+	size_t new_count = std::min(count + HEADER_SIZE, PACKET_SIZE);
 
-	// Copy buf into remaining space
-	size_t new_count = std::min(count + sizeof(MAGIC) + sizeof(PacketMetadata), PACKET_SIZE);
-	memcpy(new_buf + sizeof(MAGIC) + sizeof(PacketMetadata), buf, new_count - sizeof(MAGIC) - sizeof(PacketMetadata));
+	// Copy over metadata before buf, then buf into remaining space
+	write_header(new_buf, new_count - HEADER_SIZE);
+	memcpy(new_buf + HEADER_SIZE, buf, new_count - HEADER_SIZE);
+	overhead_end(overhead_start);
 
 	int ret = real_write(fd, new_buf, new_count);
 
 	// Hide metadata written
 	if (ret < 0) return ret;
-	return ret - sizeof(MAGIC) - sizeof(PacketMetadata);
+	return ret - HEADER_SIZE;
+}
+
+/**
+	The queue of a socket we frame. Datagram sockets often send and receive without ever
+	connecting, so they are tracked the first time they are used.
+*/
+static PacketQueue* get_socket_queue(int fd) {
+	PacketQueue* pq = get_packet_queue(fd);
+	if (pq || !query_datagram(fd)) return pq;
+	track_fd(fd);
+	return get_packet_queue(fd);
+}
+
+// From a signal handler only fds that are already tracked are framed
+static bool sends_framed(int fd) {
+	return signal_depth ? tracked_in_signal(fd) : get_socket_queue(fd) != nullptr;
+}
+
+extern "C" ssize_t send(int sockfd, const void *buf, size_t len, int flags) {
+	return sendto(sockfd, buf, len, flags, nullptr, 0);
+}
+
+extern "C" ssize_t sendto(int sockfd, const void *buf, size_t len, int flags, const struct sockaddr *dest_addr, socklen_t addrlen) {
+	initialize_real_functions();
+
+	if (!sends_framed(sockfd)) return real_sendto(sockfd, buf, len, flags, dest_addr, addrlen);
+
+	struct iovec iov = { (void*)buf, len };
+	struct msghdr msg = {};
+	msg.msg_name = (void*)dest_addr;
+	msg.msg_namelen = addrlen;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	return framed_sendmsg(sockfd, &msg, flags);
+}
+
+extern "C" ssize_t sendmsg(int sockfd, const struct msghdr *msg, int flags) {
+	initialize_real_functions();
+
+	if (!sends_framed(sockfd)) return real_sendmsg(sockfd, msg, flags);
+	return framed_sendmsg(sockfd, msg, flags);
+}
+
+// Every message gets its own header, so each is sent on its own
+extern "C" int sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags) {
+	initialize_real_functions();
+
+	if (!sends_framed(sockfd)) return real_sendmmsg(sockfd, msgvec, vlen, flags);
+
+	for (unsigned int i = 0; i < vlen; i++) {
+		ssize_t ret = framed_sendmsg(sockfd, &msgvec[i].msg_hdr, flags);
+		if (ret < 0) return i > 0 ? int(i) : -1;
+		msgvec[i].msg_len = ret;
+	}
+	return vlen;
+}
+
+extern "C" ssize_t recv(int sockfd, void *buf, size_t len, int flags) {
+	return recvfrom(sockfd, buf, len, flags, nullptr, nullptr);
+}
+
+extern "C" ssize_t recvfrom(int sockfd, void *buf, size_t len, int flags, struct sockaddr *src_addr, socklen_t *addrlen) {
+	initialize_real_functions();
+
+	PacketQueue* pq = get_socket_queue(sockfd);
+	if (!pq) return real_recvfrom(sockfd, buf, len, flags, src_addr, addrlen);
+
+	struct iovec iov = { buf, len };
+	return deliver(sockfd, pq, &iov, 1, flags, src_addr, addrlen, nullptr);
+}
+
+// Ancillary data isn't carried through the queue, so none is returned
+extern "C" ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags) {
+	initialize_real_functions();
+
+	PacketQueue* pq = get_socket_queue(sockfd);
+	if (!pq) return real_recvmsg(sockfd, msg, flags);
+
+	msg->msg_flags = 0;
+	ssize_t ret = deliver(sockfd, pq, msg->msg_iov, msg->msg_iovlen, flags,
+		(struct sockaddr*)msg->msg_name, &msg->msg_namelen, &msg->msg_flags);
+	if (ret >= 0) msg->msg_controllen = 0;
+	return ret;
+}
+
+/*
+	Waits for the first message as the flags say, then takes only what is already due, as with
+	MSG_WAITFORONE. The timeout is not applied.
+*/
+extern "C" int recvmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags, struct timespec *timeout) {
+	initialize_real_functions();
+
+	PacketQueue* pq = get_socket_queue(sockfd);
+	if (!pq) return real_recvmmsg(sockfd, msgvec, vlen, flags, timeout);
+
+	for (unsigned int i = 0; i < vlen; i++) {
+		int msg_flags = i == 0 ? flags & ~MSG_WAITFORONE : flags | MSG_DONTWAIT;
+		ssize_t ret = recvmsg(sockfd, &msgvec[i].msg_hdr, msg_flags);
+		if (ret < 0) return i > 0 ? int(i) : -1;
+		msgvec[i].msg_len = ret;
+	}
+	return vlen;
 }
 
 extern "C" int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
 	initialize_real_functions();
 
-	// Now that we know sockfd is a socket fd used for reading/writing, add it to our fds map
-	fds.emplace_back(sockfd, new PacketQueue());
-	return real_connect(sockfd, addr, addrlen);
+	int ret = real_connect(sockfd, addr, addrlen);
+
+	// Now that we know sockfd is a socket fd used for reading/writing, add it to our fds map. A
+	// non-blocking connect is tracked when it starts, not again on the EALREADY/EISCONN retries.
+	if (ret == 0 || errno == EINPROGRESS) {
+		int saved_errno = errno;
+		track_fd(sockfd);
+		record_connect(sockfd, addr, addrlen);
+		errno = saved_errno;
+	}
+	return ret;
+}
+
+extern "C" int socket(int domain, int type, int protocol) {
+	initialize_real_functions();
+
+	int fd = real_socket(domain, type, protocol);
+	remember_socket_kind(fd, type);
+	return fd;
 }
 
 extern "C" int accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen) {
@@ -323,7 +1346,8 @@ extern "C" int accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen) {
 	int fd = real_accept(sockfd, addr, addrlen);
 	if (fd > 0) {
 		// Create entry in fds map for new socket fd
-		fds.emplace_back(fd, new PacketQueue());
+		track_fd(fd);
+		record_accept(fd);
 	}
 	return fd;
 }
@@ -334,21 +1358,101 @@ extern "C" int accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen, in
 	int fd = real_accept4(sockfd, addr, addrlen, flags);
 	if (fd > 0) {
 		// Create entry in fds map for new socket fd
-		fds.emplace_back(fd, new PacketQueue());
+		track_fd(fd);
+		record_accept(fd);
 	}
 	return fd;
 }
 
+/*
+	Pipes and socketpairs are created with both ends at once, so both are tracked here and the
+	framing stays consistent between them. Whoever ends up with the other end, another thread, a
+	forked child or what it execs, must be profiled too, which is why this is opt-in.
+*/
+extern "C" int pipe(int pipefd[2]) {
+	initialize_real_functions();
+
+	int ret = real_pipe(pipefd);
+	if (ret == 0 && track_pipes) {
+		track_fd(pipefd[0]);
+		track_fd(pipefd[1]);
+	}
+	return ret;
+}
+
+extern "C" int pipe2(int pipefd[2], int flags) {
+	initialize_real_functions();
+
+	int ret = real_pipe2(pipefd, flags);
+	if (ret == 0 && track_pipes) {
+		track_fd(pipefd[0]);
+		track_fd(pipefd[1]);
+	}
+	return ret;
+}
+
+extern "C" int socketpair(int domain, int type, int protocol, int sv[2]) {
+	initialize_real_functions();
+
+	int ret = real_socketpair(domain, type, protocol, sv);
+	if (ret == 0) {
+		remember_socket_kind(sv[0], type);
+		remember_socket_kind(sv[1], type);
+	}
+	if (ret == 0 && track_pipes) {
+		track_fd(sv[0]);
+		track_fd(sv[1]);
+	}
+	return ret;
+}
+
+// A peer reading to the end of the stream still needs what we've buffered
+extern "C" int shutdown(int fd, int how) {
+	initialize_real_functions();
+
+	Coalescer* c = get_coalescer(fd);
+	if (c && get_packet_queue(fd) && how != SHUT_RD) flush_fd(fd, c, true);
+	return real_shutdown(fd, how);
+}
+
 extern "C" int close(int fd) {
 	initialize_real_functions();
+	untrack_eventfd(fd);
 
 	// Remove entry from fds map
 	for (auto it = fds.begin(); it != fds.end(); it++) {
 		if (it->first == fd) {
-			delete it->second;
+			Coalescer* c = get_coalescer(fd);
+			if (c) {
+				lock_coalescer(c);
+				drain_locked(fd, c);
+				// Whatever the socket still won't take would go to the fd's next owner
+				if (c->len > 0) {
+					c->len = 0;
+					set_pending(fd, false);
+				}
+				c->lock.clear(std::memory_order_release);
+			}
+			// Packets nobody read go back to where they came from
+			PacketQueue* pq = it->second;
+			while (pq->get_size() > 0) {
+				release_packet(fd, *pq->get_head());
+				pq->pop();
+			}
+			delete pq;
 			fds.erase(it);
+			FdMetrics* fm = get_fd_metrics(fd);
+			if (fm) fm->tracked = false;
+			if (fd < MAX_METRICS_FDS) retire_connection_histograms(fd);
+			auto dec = frame_decoders.find(fd);
+			if (dec != frame_decoders.end()) {
+				if (dec->second.partial.buffer) mp.return_buf(dec->second.partial.buffer);
+				frame_decoders.erase(dec);
+			}
+			record_close(fd);
 			break;
 		}
 	}
+	if (fd >= 0 && fd < MAX_METRICS_FDS) socket_kinds[fd] = SocketKind::UNKNOWN;
 	return real_close(fd);
 }
\ No newline at end of file
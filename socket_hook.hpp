@@ -1,10 +1,133 @@
 #ifndef SOCKET_HOOK_HPP
 #define SOCKET_HOOK_HPP
 
+#include <cstdint>
+#include <atomic>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#include "utils/loghistogram.hpp"
+#include "utils/time.hpp"
+
 struct PacketMetadata {
     uint32_t number_server_calls;
     uint32_t total_virtual_delay;
     uint32_t data_size;
 };
 
+typedef ssize_t(*read_t)(int fd, void *buf, size_t count);
+typedef ssize_t(*write_t)(int fd, const void *buf, size_t count);
+typedef int(*epoll_pwait_t)(int epfd, struct epoll_event events[], int maxevents, int timeout, const sigset_t* sigmask);
+typedef int(*close_t)(int fd);
+typedef int(*connect_t)(int sockfd, const struct sockaddr *addr, socklen_t addrlen);
+typedef int(*accept_t)(int sockfd, struct sockaddr *addr, socklen_t *addrlen);
+typedef int(*accept4_t)(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags);
+typedef int(*pipe_t)(int pipefd[2]);
+typedef int(*pipe2_t)(int pipefd[2], int flags);
+typedef int(*socketpair_t)(int domain, int type, int protocol, int sv[2]);
+typedef ssize_t(*sendto_t)(int sockfd, const void *buf, size_t len, int flags, const struct sockaddr *dest_addr, socklen_t addrlen);
+typedef ssize_t(*sendmsg_t)(int sockfd, const struct msghdr *msg, int flags);
+typedef int(*sendmmsg_t)(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags);
+typedef ssize_t(*recvfrom_t)(int sockfd, void *buf, size_t len, int flags, struct sockaddr *src_addr, socklen_t *addrlen);
+typedef ssize_t(*recvmsg_t)(int sockfd, struct msghdr *msg, int flags);
+typedef int(*recvmmsg_t)(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags, struct timespec *timeout);
+typedef int(*shutdown_t)(int sockfd, int how);
+typedef int(*socket_t)(int domain, int type, int protocol);
+
+// Unhooked libc functions, for use by code inside DCuz that must bypass the framing layer.
+// Only valid after initialize_real_functions().
+extern read_t real_read;
+extern write_t real_write;
+extern epoll_pwait_t real_epoll_pwait;
+extern close_t real_close;
+extern connect_t real_connect;
+extern accept_t real_accept;
+extern accept4_t real_accept4;
+extern pipe_t real_pipe;
+extern pipe2_t real_pipe2;
+extern socketpair_t real_socketpair;
+extern sendto_t real_sendto;
+extern sendmsg_t real_sendmsg;
+extern sendmmsg_t real_sendmmsg;
+extern recvfrom_t real_recvfrom;
+extern recvmsg_t real_recvmsg;
+extern recvmmsg_t real_recvmmsg;
+extern shutdown_t real_shutdown;
+extern socket_t real_socket;
+
+void initialize_real_functions();
+
+// Set by DCUZ_TRACK_PIPES: frame pipes and socketpairs too, tracking both ends as they are created
+extern std::atomic<bool> track_pipes;
+
+/*
+	Tracking lives in the process image, but the fds outlive an exec, and whoever holds their other
+	end keeps framing. execve passes the tracked fds without FD_CLOEXEC to the new image in
+	DCUZ_TRACKED_FDS, as a comma-separated list, and it tracks them again at startup.
+*/
+// Writes the list to `out`, returning false if there are none or they don't fit
+bool list_inherited_fds(char* out, size_t len);
+void track_inherited_fds(const char* list);
+
+// Whether a tracked fd holds input the application hasn't read yet: queued packets, or a frame
+// partway through decoding
+bool has_buffered_input();
+
+/*
+	How many of the application's signal handlers this thread is running, kept by the sigaction
+	hook. Writes from a handler, like an event loop's self-pipe, are framed without waiting out our
+	delay or taking our locks, since the thread they interrupted may be holding them.
+*/
+extern thread_local int signal_depth __attribute__((tls_model("initial-exec")));
+
+/*
+	Write coalescing, set by DCUZ_COALESCE. Framed writes to a tracked stream are gathered per fd,
+	each frame keeping its own header, and sent together once the buffer fills, before the process
+	blocks to read, or `deadline_ns` after the oldest was written at the latest.
+*/
+bool start_coalescing(uint64_t deadline_ns);
+// Sends what every fd has buffered. With `wait` false, fds that are busy are skipped, so it is
+// async-signal-safe for finish_profiling, and can't wait on a thread that is waiting on us.
+void flush_output(bool wait = true);
+// Like flush_output, but waits for full non-blocking fds to take everything, for when the buffers
+// are about to be lost to an exec or exit. Close and shutdown drain their fd the same way.
+void drain_output(bool wait = true);
+// Called in a forked child. What was buffered is the parent's to send, so the child drops it.
+void reset_coalescing_after_fork();
+
+// Per-fd counters, indexed by fd number. Written by the hooks and read lock-free by the metrics thread.
+constexpr int MAX_METRICS_FDS = 1024;
+struct FdMetrics {
+    std::atomic<bool> tracked;
+    std::atomic<size_t> queue_depth;
+    std::atomic<uint64_t> packets;
+    std::atomic<uint64_t> held_ns;      // Delay added to packet wakeups because we are virtually slower
+    std::atomic<uint64_t> credited_ns;  // Virtual delay credited because the peer was virtually slower
+};
+extern FdMetrics fd_metrics[MAX_METRICS_FDS];
+
+/*
+	Latency and size histograms of the packets a connection delivered, recorded when
+	DCUZ_HISTOGRAMS is set. Each tracked socket gets its own, and the most recently closed
+	connections keep theirs, so they are dumped at exit. Older ones are summed into one set, and
+	their memory reused. The peer is looked up on its first packet.
+*/
+struct ConnectionHistograms {
+	int fd;
+	char peer[64];
+	LogHistogram hold_ns;         // Time packets were held past their arrival by the virtual delay
+	LogHistogram interarrival_ns; // Time between consecutive packets arriving
+	LogHistogram payload_bytes;
+	time_ns last_arrival;
+	ConnectionHistograms* next;
+};
+extern std::atomic<bool> record_histograms;
+
+// Appends every connection's histograms, and totals over all of them, to the file at `path`
+bool dump_connection_histograms(const char* path);
+// Called in a forked child, whose connections start counting from zero
+void reset_connection_histograms();
+
 #endif //SOCKET_HOOK_HPP
@@ -0,0 +1,194 @@
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <cerrno>
+#include <cstdlib>
+
+#include "delay.hpp"
+#include "profiler.hpp"
+#include "time_hook.hpp"
+
+extern Profiler p;
+
+typedef int(*pthread_create_t)(pthread_t* thread, const pthread_attr_t* attr, void* (*start_routine)(void*), void* arg);
+typedef int(*pthread_mutex_lock_t)(pthread_mutex_t* mutex);
+typedef int(*pthread_mutex_unlock_t)(pthread_mutex_t* mutex);
+typedef int(*pthread_cond_wait_t)(pthread_cond_t* cond, pthread_mutex_t* mutex);
+typedef int(*pthread_cond_timedwait_t)(pthread_cond_t* cond, pthread_mutex_t* mutex, const struct timespec* abstime);
+typedef int(*pthread_cond_signal_t)(pthread_cond_t* cond);
+typedef int(*eventfd_create_t)(unsigned int initval, int flags);
+typedef int(*eventfd_read_t)(int fd, eventfd_t* value);
+typedef int(*eventfd_write_t)(int fd, eventfd_t value);
+
+pthread_create_t real_pthread_create = nullptr;
+pthread_mutex_lock_t real_pthread_mutex_lock = nullptr;
+pthread_mutex_lock_t real_pthread_mutex_trylock = nullptr;
+pthread_mutex_unlock_t real_pthread_mutex_unlock = nullptr;
+pthread_cond_wait_t real_pthread_cond_wait = nullptr;
+pthread_cond_timedwait_t real_pthread_cond_timedwait = nullptr;
+pthread_cond_signal_t real_pthread_cond_signal = nullptr;
+pthread_cond_signal_t real_pthread_cond_broadcast = nullptr;
+eventfd_create_t real_eventfd = nullptr;
+eventfd_read_t real_eventfd_read = nullptr;
+eventfd_write_t real_eventfd_write = nullptr;
+
+struct ThreadStart {
+	void* (*start_routine)(void*);
+	void* arg;
+	uint64_t local_delay_ns;
+};
+
+/*
+	Runs the thread's own start routine once it has inherited its creator's delay count. Otherwise
+	it would start at zero and owe every delay added before it existed.
+*/
+static void* start_thread(void* data) {
+	ThreadStart start = *static_cast<ThreadStart*>(data);
+	free(data);
+
+	set_local_delay(start.local_delay_ns);
+	return start.start_routine(start.arg);
+}
+
+extern "C" int pthread_create(pthread_t* thread, const pthread_attr_t* attr, void* (*start_routine)(void*), void* arg) {
+	if (!real_pthread_create) {
+		real_pthread_create = (pthread_create_t) dlsym(RTLD_NEXT, "pthread_create");
+	}
+
+	if (!inject_delays) return real_pthread_create(thread, attr, start_routine, arg);
+
+	ThreadStart* start = static_cast<ThreadStart*>(malloc(sizeof(ThreadStart)));
+	if (!start) return real_pthread_create(thread, attr, start_routine, arg);
+	*start = { start_routine, arg, get_local_delay() };
+
+	int ret = real_pthread_create(thread, attr, start_thread, start);
+	if (ret != 0) free(start);
+	return ret;
+}
+
+/*
+	Whoever held the mutex last handed it to us, so take their credit. Only pay our own debt first
+	if we actually have to wait for it. Any other trylock result is the lock's answer, like a robust
+	mutex's EOWNERDEAD, which already made us the owner.
+*/
+extern "C" int pthread_mutex_lock(pthread_mutex_t* mutex) {
+	if (!real_pthread_mutex_lock) {
+		real_pthread_mutex_lock = (pthread_mutex_lock_t) dlsym(RTLD_NEXT, "pthread_mutex_lock");
+		real_pthread_mutex_trylock = (pthread_mutex_lock_t) dlsym(RTLD_NEXT, "pthread_mutex_trylock");
+	}
+	// Called often enough, and never from a signal handler, to pick up newly mapped code
+	p.refresh_modules_if_changed();
+
+	if (!inject_delays) return real_pthread_mutex_lock(mutex);
+
+	int ret = real_pthread_mutex_trylock(mutex);
+	if (ret == EBUSY) {
+		pre_block();
+		ret = real_pthread_mutex_lock(mutex);
+	}
+	if (ret == 0 || ret == EOWNERDEAD) post_wake(mutex);
+	return ret;
+}
+
+/*
+	Unlocking may let a waiting thread run, so pay our debt first. Otherwise the waiter would run
+	ahead of a thread that should have been slowed down.
+*/
+extern "C" int pthread_mutex_unlock(pthread_mutex_t* mutex) {
+	if (!real_pthread_mutex_unlock) {
+		real_pthread_mutex_unlock = (pthread_mutex_unlock_t) dlsym(RTLD_NEXT, "pthread_mutex_unlock");
+	}
+
+	wake(mutex);
+	return real_pthread_mutex_unlock(mutex);
+}
+
+/*
+	The wait releases and reacquires the mutex inside libc, where our lock hooks don't see it, so
+	take credit from both the signaller and the mutex's last holder.
+*/
+extern "C" int pthread_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex) {
+	if (!real_pthread_cond_wait) {
+		real_pthread_cond_wait = (pthread_cond_wait_t) dlsym(RTLD_NEXT, "pthread_cond_wait");
+	}
+
+	wake(mutex);
+	pre_block();
+	int ret = real_pthread_cond_wait(cond, mutex);
+	post_wake(cond);
+	post_wake(mutex);
+	return ret;
+}
+
+extern "C" int pthread_cond_timedwait(pthread_cond_t* cond, pthread_mutex_t* mutex, const struct timespec* abstime) {
+	if (!real_pthread_cond_timedwait) {
+		real_pthread_cond_timedwait = (pthread_cond_timedwait_t) dlsym(RTLD_NEXT, "pthread_cond_timedwait");
+	}
+
+	// The deadline was taken from the virtual clock
+	struct timespec real_abstime;
+	if (virtualize_time) {
+		real_abstime = to_real_deadline(*abstime);
+		abstime = &real_abstime;
+	}
+
+	wake(mutex);
+	pre_block();
+	int ret = real_pthread_cond_timedwait(cond, mutex, abstime);
+	// A timeout wasn't a handoff, but the mutex still was
+	if (ret == 0) post_wake(cond);
+	post_wake(mutex);
+	return ret;
+}
+
+extern "C" int pthread_cond_signal(pthread_cond_t* cond) {
+	if (!real_pthread_cond_signal) {
+		real_pthread_cond_signal = (pthread_cond_signal_t) dlsym(RTLD_NEXT, "pthread_cond_signal");
+	}
+
+	wake(cond);
+	return real_pthread_cond_signal(cond);
+}
+
+extern "C" int pthread_cond_broadcast(pthread_cond_t* cond) {
+	if (!real_pthread_cond_broadcast) {
+		real_pthread_cond_broadcast = (pthread_cond_signal_t) dlsym(RTLD_NEXT, "pthread_cond_broadcast");
+	}
+
+	wake(cond);
+	return real_pthread_cond_broadcast(cond);
+}
+
+/*
+	Eventfds are how event loops wake each other up, so remember which fds are eventfds. The read
+	and write hooks treat them as handoffs, just like the libc helpers below.
+*/
+extern "C" int eventfd(unsigned int initval, int flags) {
+	if (!real_eventfd) {
+		real_eventfd = (eventfd_create_t) dlsym(RTLD_NEXT, "eventfd");
+	}
+
+	int fd = real_eventfd(initval, flags);
+	track_eventfd(fd);
+	return fd;
+}
+
+extern "C" int eventfd_read(int fd, eventfd_t* value) {
+	if (!real_eventfd_read) {
+		real_eventfd_read = (eventfd_read_t) dlsym(RTLD_NEXT, "eventfd_read");
+	}
+
+	pre_block();
+	int ret = real_eventfd_read(fd, value);
+	if (ret == 0) post_wake(eventfd_key(fd));
+	return ret;
+}
+
+extern "C" int eventfd_write(int fd, eventfd_t value) {
+	if (!real_eventfd_write) {
+		real_eventfd_write = (eventfd_write_t) dlsym(RTLD_NEXT, "eventfd_write");
+	}
+
+	wake(eventfd_key(fd));
+	return real_eventfd_write(fd, value);
+}
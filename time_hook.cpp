@@ -0,0 +1,173 @@
+#include <dlfcn.h>
+#include <errno.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+
+#include "profiler.hpp"
+#include "time_hook.hpp"
+#include "utils/time.hpp"
+
+typedef int(*nanosleep_t)(const struct timespec* request, struct timespec* remain);
+typedef int(*usleep_t)(useconds_t usec);
+typedef unsigned int(*sleep_t)(unsigned int seconds);
+typedef int(*timerfd_settime_t)(int fd, int flags, const struct itimerspec* new_value, struct itimerspec* old_value);
+
+nanosleep_t real_nanosleep = nullptr;
+usleep_t real_usleep = nullptr;
+sleep_t real_sleep = nullptr;
+timerfd_settime_t real_timerfd_settime = nullptr;
+
+extern Profiler p;
+extern size_t delay_length_ns;
+extern std::atomic<uint64_t> delayed_ns;
+
+std::atomic<bool> virtualize_time(false);
+
+// Clocks that tell the time. CPU-time clocks only count running, which our delays don't change.
+static bool is_virtualized(clockid_t clock) {
+	switch (clock) {
+	case CLOCK_REALTIME:
+	case CLOCK_REALTIME_COARSE:
+	case CLOCK_MONOTONIC:
+	case CLOCK_MONOTONIC_COARSE:
+	case CLOCK_MONOTONIC_RAW:
+	case CLOCK_BOOTTIME:
+		return virtualize_time;
+	default:
+		return false;
+	}
+}
+
+// The same delay that is taken off the runtime at exit: our own hits, plus what packets credited
+static uint64_t virtual_delay_ns() {
+	return delayed_ns.load() + p.get_hit_counts() * delay_length_ns;
+}
+
+// Latest virtual time handed out per clock. Hits are only added when samples are drained, so the
+// delay can jump ahead by more than the clock moved since the last read, and monotonic clocks
+// must not go back. The wall clock is left free to be stepped.
+static constexpr clockid_t MAX_CLOCKS = 16;
+static std::atomic<time_ns> last_virtual_ns[MAX_CLOCKS];
+
+static time_ns to_virtual(clockid_t clock, time_ns real) {
+	uint64_t delay = virtual_delay_ns();
+	time_ns now = real > delay ? real - delay : 0;
+	if (clock == CLOCK_REALTIME || clock == CLOCK_REALTIME_COARSE || clock >= MAX_CLOCKS) return now;
+
+	std::atomic<time_ns> &last = last_virtual_ns[clock];
+	time_ns seen = last.load();
+	while (seen < now && !last.compare_exchange_weak(seen, now));
+	return std::max(seen, now);
+}
+
+static time_ns virtual_now(clockid_t clock) {
+	timespec ts;
+	real_clock_gettime(clock, &ts);
+	return to_virtual(clock, from_timespec(ts));
+}
+
+timespec to_real_deadline(const timespec &virtual_deadline) {
+	return to_timespec(from_timespec(virtual_deadline) + virtual_delay_ns());
+}
+
+/**
+	Sleeps until `clock` reaches a virtual deadline. Delay added during a sleep pushes the deadline
+	out in real time, so this keeps sleeping for whatever virtual time is still left.
+*/
+static int virtual_sleep(clockid_t clock, int flags, const struct timespec* request, struct timespec* remain) {
+	time_ns deadline = from_timespec(*request);
+	if (!(flags & TIMER_ABSTIME)) deadline += virtual_now(clock);
+
+	while (true) {
+		time_ns now = virtual_now(clock);
+		if (now >= deadline) return 0;
+
+		timespec left = to_timespec(deadline - now);
+		int ret = real_clock_nanosleep(clock, 0, &left, nullptr);
+		if (ret != 0) {
+			if (remain && !(flags & TIMER_ABSTIME)) {
+				now = virtual_now(clock);
+				*remain = to_timespec(deadline > now ? deadline - now : 0);
+			}
+			return ret;
+		}
+	}
+}
+
+extern "C" int clock_gettime(clockid_t clock, struct timespec* tp) {
+	initialize_real_clock();
+
+	int ret = real_clock_gettime(clock, tp);
+	if (ret == 0 && is_virtualized(clock)) *tp = to_timespec(to_virtual(clock, from_timespec(*tp)));
+	return ret;
+}
+
+extern "C" int clock_nanosleep(clockid_t clock, int flags, const struct timespec* request, struct timespec* remain) {
+	initialize_real_clock();
+
+	if (!is_virtualized(clock)) return real_clock_nanosleep(clock, flags, request, remain);
+	return virtual_sleep(clock, flags, request, remain);
+}
+
+extern "C" int nanosleep(const struct timespec* request, struct timespec* remain) {
+	if (!real_nanosleep) {
+		real_nanosleep = (nanosleep_t) dlsym(RTLD_NEXT, "nanosleep");
+	}
+	initialize_real_clock();
+
+	if (!virtualize_time) return real_nanosleep(request, remain);
+
+	// nanosleep measures against CLOCK_MONOTONIC
+	int ret = virtual_sleep(CLOCK_MONOTONIC, 0, request, remain);
+	if (ret != 0) {
+		errno = ret;
+		return -1;
+	}
+	return 0;
+}
+
+// libc's usleep and sleep call nanosleep internally, where our hook doesn't see it
+extern "C" int usleep(useconds_t usec) {
+	if (!real_usleep) {
+		real_usleep = (usleep_t) dlsym(RTLD_NEXT, "usleep");
+	}
+	if (!virtualize_time) return real_usleep(usec);
+
+	timespec request = to_timespec(time_ns(usec) * 1000);
+	return nanosleep(&request, nullptr);
+}
+
+extern "C" unsigned int sleep(unsigned int seconds) {
+	if (!real_sleep) {
+		real_sleep = (sleep_t) dlsym(RTLD_NEXT, "sleep");
+	}
+	if (!virtualize_time) return real_sleep(seconds);
+
+	timespec request = { time_t(seconds), 0 };
+	timespec remain = { 0, 0 };
+	if (nanosleep(&request, &remain) == 0) return 0;
+	return remain.tv_sec + (remain.tv_nsec > 0);
+}
+
+/*
+	Absolute expirations are virtual deadlines, so move them to where they fall in real time.
+	Relative ones and intervals are left alone: they can't follow delay added after they are armed
+	without rearming the timer, and an event loop rechecks its clock when the timer fires anyway.
+*/
+extern "C" int timerfd_settime(int fd, int flags, const struct itimerspec* new_value, struct itimerspec* old_value) {
+	if (!real_timerfd_settime) {
+		real_timerfd_settime = (timerfd_settime_t) dlsym(RTLD_NEXT, "timerfd_settime");
+	}
+
+	bool armed = new_value && (new_value->it_value.tv_sec != 0 || new_value->it_value.tv_nsec != 0);
+	if (!virtualize_time || !(flags & TFD_TIMER_ABSTIME) || !armed) {
+		return real_timerfd_settime(fd, flags, new_value, old_value);
+	}
+
+	struct itimerspec real_value = *new_value;
+	real_value.it_value = to_real_deadline(new_value->it_value);
+	return real_timerfd_settime(fd, flags, &real_value, old_value);
+}
@@ -0,0 +1,17 @@
+#ifndef TIME_HOOK_HPP
+#define TIME_HOOK_HPP
+
+#include <atomic>
+#include <ctime>
+
+/*
+	With DCUZ_VIRTUAL_TIME set, the application sees virtual time: its clocks run behind the real
+	ones by the virtual delay accumulated so far, and its sleeps and timers last for virtual time.
+	Timer-driven work then slows down along with everything else when the line is "sped up".
+*/
+extern std::atomic<bool> virtualize_time;
+
+// Where an absolute virtual deadline on any clock falls in real time
+timespec to_real_deadline(const timespec &virtual_deadline);
+
+#endif //TIME_HOOK_HPP
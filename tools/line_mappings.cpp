@@ -0,0 +1,499 @@
+/*
+    Native replacement for generate_line_mappings.py. Maps the ELF file, decodes .debug_line
+    (DWARF 2-5) directly, and writes the same `module,file,line,offset,size` CSV, with one row per
+    contiguous block of a line's instructions.
+
+        line_mappings [-o out.csv] [-m module] [-s source_filter]... elf_path
+
+    With -s, only lines whose source path contains one of the filters are written.
+*/
+#include <elf.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Line program opcodes, from the DWARF 5 spec section 7.22
+enum {
+    DW_LNS_copy = 1, DW_LNS_advance_pc, DW_LNS_advance_line, DW_LNS_set_file, DW_LNS_set_column,
+    DW_LNS_negate_stmt, DW_LNS_set_basic_block, DW_LNS_const_add_pc, DW_LNS_fixed_advance_pc,
+};
+enum { DW_LNE_end_sequence = 1, DW_LNE_set_address, DW_LNE_define_file };
+enum { DW_LNCT_path = 1, DW_LNCT_directory_index };
+enum {
+    DW_FORM_block2 = 0x03, DW_FORM_block4 = 0x04, DW_FORM_data2 = 0x05, DW_FORM_data4 = 0x06,
+    DW_FORM_data8 = 0x07, DW_FORM_string = 0x08, DW_FORM_block = 0x09, DW_FORM_block1 = 0x0a,
+    DW_FORM_data1 = 0x0b, DW_FORM_sdata = 0x0d, DW_FORM_strp = 0x0e, DW_FORM_udata = 0x0f,
+    DW_FORM_data16 = 0x1e, DW_FORM_line_strp = 0x1f,
+};
+
+struct Section {
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+};
+
+/*
+    Bounds-checked little-endian cursor. Reading past the end leaves `ok` false and returns zeros,
+    so callers only have to check once per unit.
+*/
+struct Reader {
+    const uint8_t* p;
+    const uint8_t* end;
+    bool ok = true;
+
+    Reader(const uint8_t* p, const uint8_t* end): p(p), end(end) {}
+
+    bool has(size_t n) {
+        if (ok && size_t(end - p) >= n) return true;
+        ok = false;
+        return false;
+    }
+
+    uint64_t fixed(size_t n) {
+        if (!has(n)) return 0;
+        uint64_t v = 0;
+        for (size_t i = 0; i < n; i++) v |= uint64_t(p[i]) << (8 * i);
+        p += n;
+        return v;
+    }
+
+    uint64_t uleb() {
+        uint64_t v = 0;
+        for (unsigned shift = 0; has(1); shift += 7) {
+            uint8_t b = *p++;
+            if (shift < 64) v |= uint64_t(b & 0x7f) << shift;
+            if (!(b & 0x80)) break;
+        }
+        return v;
+    }
+
+    int64_t sleb() {
+        int64_t v = 0;
+        unsigned shift = 0;
+        uint8_t b = 0;
+        while (has(1)) {
+            b = *p++;
+            if (shift < 64) v |= int64_t(b & 0x7f) << shift;
+            shift += 7;
+            if (!(b & 0x80)) break;
+        }
+        if (shift < 64 && (b & 0x40)) v |= -(int64_t(1) << shift);
+        return v;
+    }
+
+    const char* cstr() {
+        const uint8_t* nul = static_cast<const uint8_t*>(memchr(p, 0, ok ? end - p : 0));
+        if (!nul) {
+            ok = false;
+            return "";
+        }
+        const char* s = reinterpret_cast<const char*>(p);
+        p = nul + 1;
+        return s;
+    }
+
+    void skip(size_t n) {
+        if (has(n)) p += n;
+    }
+};
+
+struct Range {
+    uint64_t offset;
+    uint64_t size;
+    uint32_t file;
+    uint32_t line;
+};
+
+struct LineRow {
+    uint64_t address;
+    uint32_t file;
+    uint32_t line;
+};
+
+// Marks files excluded by the source filter or missing from the file table
+constexpr uint32_t NO_FILE = UINT32_MAX;
+
+static Section debug_line, debug_line_str, debug_str;
+static std::vector<std::string> filters;
+
+// Source paths are shared by every unit that includes them, so ranges refer to them by index
+static std::vector<std::string> paths;
+static std::unordered_map<std::string, uint32_t> path_ids;
+static std::vector<Range> ranges;
+
+static const char* section_string(const Section &section, uint64_t offset) {
+    if (offset >= section.size) return "";
+    const char* s = reinterpret_cast<const char*>(section.data + offset);
+    return memchr(s, 0, section.size - offset) ? s : "";
+}
+
+static std::string join_path(const std::string &dir, const std::string &name) {
+    if (dir.empty() || name[0] == '/') return name;
+    return dir.back() == '/' ? dir + name : dir + "/" + name;
+}
+
+static uint32_t intern_path(const std::string &path) {
+    if (!filters.empty()) {
+        bool keep = false;
+        for (const std::string &filter : filters) keep |= path.find(filter) != std::string::npos;
+        if (!keep) return NO_FILE;
+    }
+    auto it = path_ids.find(path);
+    if (it != path_ids.end()) return it->second;
+    path_ids.emplace(path, paths.size());
+    paths.push_back(path);
+    return paths.size() - 1;
+}
+
+/**
+    Reads one attribute of a DWARF 5 directory or file entry. Strings are returned through `str`,
+    and constants through `num`; anything else is skipped.
+*/
+static void read_form(Reader &r, uint64_t form, bool dwarf64, const char** str, uint64_t* num) {
+    size_t offset_size = dwarf64 ? 8 : 4;
+    switch (form) {
+        case DW_FORM_string: *str = r.cstr(); break;
+        case DW_FORM_line_strp: *str = section_string(debug_line_str, r.fixed(offset_size)); break;
+        case DW_FORM_strp: *str = section_string(debug_str, r.fixed(offset_size)); break;
+        case DW_FORM_data1: *num = r.fixed(1); break;
+        case DW_FORM_data2: *num = r.fixed(2); break;
+        case DW_FORM_data4: *num = r.fixed(4); break;
+        case DW_FORM_data8: *num = r.fixed(8); break;
+        case DW_FORM_udata: *num = r.uleb(); break;
+        case DW_FORM_sdata: *num = r.sleb(); break;
+        case DW_FORM_data16: r.skip(16); break;
+        case DW_FORM_block1: r.skip(r.fixed(1)); break;
+        case DW_FORM_block2: r.skip(r.fixed(2)); break;
+        case DW_FORM_block4: r.skip(r.fixed(4)); break;
+        case DW_FORM_block: r.skip(r.uleb()); break;
+        default:
+            std::cerr << "Unsupported form 0x" << std::hex << form << std::dec << " in line table header" << std::endl;
+            r.ok = false;
+    }
+}
+
+/**
+    Reads a DWARF 5 directory or file name table. Each entry is a list of (content type, form)
+    attributes described up front. Appends each entry's path and directory index.
+*/
+static void read_entry_table(Reader &r, bool dwarf64, std::vector<std::string> &names, std::vector<uint64_t> &dirs) {
+    uint8_t format_count = r.fixed(1);
+    std::vector<std::pair<uint64_t, uint64_t>> format;
+    for (uint8_t i = 0; i < format_count && r.ok; i++) {
+        uint64_t type = r.uleb();
+        uint64_t form = r.uleb();
+        format.emplace_back(type, form);
+    }
+
+    uint64_t count = r.uleb();
+    for (uint64_t i = 0; i < count && r.ok; i++) {
+        const char* name = "";
+        uint64_t dir = 0;
+        for (auto &[type, form] : format) {
+            const char* str = "";
+            uint64_t num = 0;
+            read_form(r, form, dwarf64, &str, &num);
+            if (type == DW_LNCT_path) name = str;
+            if (type == DW_LNCT_directory_index) dir = num;
+        }
+        names.push_back(name);
+        dirs.push_back(dir);
+    }
+}
+
+/**
+    Turns the rows of one sequence into ranges, each covering the addresses up to the next row.
+    Consecutive rows of the same line are merged into one range.
+*/
+static void flush_sequence(std::vector<LineRow> &rows, uint64_t end_address) {
+    // Sequences of code dropped by the linker are relocated to a tombstone address of 0 or -1
+    if (!rows.empty() && rows[0].address != 0 && rows[0].address < UINT64_MAX - 1) {
+        size_t first = ranges.size();
+        for (size_t i = 0; i < rows.size(); i++) {
+            uint64_t next = i + 1 < rows.size() ? rows[i + 1].address : end_address;
+            if (rows[i].file == NO_FILE || next <= rows[i].address) continue;
+
+            if (ranges.size() > first) {
+                Range &prev = ranges.back();
+                if (prev.file == rows[i].file && prev.line == rows[i].line && prev.offset + prev.size == rows[i].address) {
+                    prev.size = next - prev.offset;
+                    continue;
+                }
+            }
+            ranges.push_back({rows[i].address, next - rows[i].address, rows[i].file, rows[i].line});
+        }
+    }
+    rows.clear();
+}
+
+/**
+    Decodes the line program unit starting at `r` and appends its ranges. Returns false if the
+    unit is malformed, since the length of what follows can't be trusted either.
+*/
+static bool decode_unit(Reader &r) {
+    bool dwarf64 = false;
+    uint64_t unit_length = r.fixed(4);
+    if (unit_length == 0xffffffff) {
+        dwarf64 = true;
+        unit_length = r.fixed(8);
+    }
+    if (!r.has(unit_length)) return false;
+    const uint8_t* unit_end = r.p + unit_length;
+    Reader u(r.p, unit_end);
+    r.p = unit_end;
+
+    uint16_t version = u.fixed(2);
+    if (version < 2 || version > 5) {
+        std::cerr << "Skipping line table with unsupported DWARF version " << version << std::endl;
+        return true;
+    }
+    uint8_t address_size = 8;
+    if (version >= 5) {
+        address_size = u.fixed(1);
+        u.fixed(1); // segment_selector_size
+    }
+    uint64_t header_length = u.fixed(dwarf64 ? 8 : 4);
+    if (!u.has(header_length)) return false;
+    const uint8_t* program = u.p + header_length;
+
+    uint8_t min_inst_length = u.fixed(1);
+    if (version >= 4) u.fixed(1); // maximum_operations_per_instruction, only used by VLIW targets
+    u.fixed(1); // default_is_stmt, every row is kept whether or not it's a statement
+    int8_t line_base = int8_t(u.fixed(1));
+    uint8_t line_range = u.fixed(1);
+    uint8_t opcode_base = u.fixed(1);
+    std::vector<uint8_t> opcode_lengths(opcode_base > 0 ? opcode_base - 1 : 0);
+    for (uint8_t &len : opcode_lengths) len = u.fixed(1);
+    if (line_range == 0) return false;
+
+    // Resolve file names to paths up front. DWARF 5 indexes files and directories from 0, with
+    // entry 0 the compilation directory and primary file. Earlier versions index both from 1,
+    // with directory 0 meaning the compilation directory, which isn't in the table.
+    std::vector<uint32_t> files;
+    if (version >= 5) {
+        std::vector<std::string> dir_names, file_names;
+        std::vector<uint64_t> unused, file_dirs;
+        read_entry_table(u, dwarf64, dir_names, unused);
+        read_entry_table(u, dwarf64, file_names, file_dirs);
+        for (size_t i = 0; i < file_names.size(); i++) {
+            std::string dir = file_dirs[i] < dir_names.size() ? dir_names[file_dirs[i]] : "";
+            files.push_back(intern_path(join_path(dir, file_names[i])));
+        }
+    } else {
+        std::vector<std::string> dir_names;
+        while (u.ok) {
+            const char* dir = u.cstr();
+            if (!*dir) break;
+            dir_names.push_back(dir);
+        }
+        files.push_back(NO_FILE);
+        while (u.ok) {
+            const char* name = u.cstr();
+            if (!*name) break;
+            uint64_t dir = u.uleb();
+            u.uleb(); // mtime
+            u.uleb(); // length
+            files.push_back(intern_path(join_path(dir >= 1 && dir <= dir_names.size() ? dir_names[dir - 1] : "", name)));
+        }
+    }
+    if (!u.ok) return false;
+    u.p = program;
+
+    uint64_t address = 0;
+    uint64_t file = 1;
+    int64_t line = 1;
+    std::vector<LineRow> rows;
+    auto emit = [&]() {
+        uint32_t id = file < files.size() ? files[file] : NO_FILE;
+        rows.push_back({address, id, uint32_t(line)});
+    };
+
+    while (u.ok && u.p < unit_end) {
+        uint8_t opcode = u.fixed(1);
+        if (opcode >= opcode_base) {
+            uint8_t adjusted = opcode - opcode_base;
+            address += uint64_t(adjusted / line_range) * min_inst_length;
+            line += line_base + adjusted % line_range;
+            emit();
+            continue;
+        }
+
+        switch (opcode) {
+            case 0: {
+                uint64_t len = u.uleb();
+                if (len == 0 || !u.has(len)) break;
+                const uint8_t* next = u.p + len;
+                uint8_t sub = u.fixed(1);
+                if (sub == DW_LNE_end_sequence) {
+                    flush_sequence(rows, address);
+                    address = 0;
+                    file = 1;
+                    line = 1;
+                } else if (sub == DW_LNE_set_address) {
+                    address = u.fixed(std::min<uint64_t>(len - 1, address_size));
+                } else if (sub == DW_LNE_define_file) {
+                    files.push_back(intern_path(u.cstr()));
+                }
+                u.p = next;
+                break;
+            }
+            case DW_LNS_copy: emit(); break;
+            case DW_LNS_advance_pc: address += u.uleb() * min_inst_length; break;
+            case DW_LNS_advance_line: line += u.sleb(); break;
+            case DW_LNS_set_file: file = u.uleb(); break;
+            case DW_LNS_const_add_pc: address += uint64_t((255 - opcode_base) / line_range) * min_inst_length; break;
+            case DW_LNS_fixed_advance_pc: address += u.fixed(2); break;
+            default:
+                // Opcodes with no effect on the rows we emit, or unknown ones, whose operand
+                // counts the header gives us
+                for (uint8_t i = 0; i < opcode_lengths[opcode - 1]; i++) u.uleb();
+        }
+    }
+    return u.ok;
+}
+
+static bool find_sections(const uint8_t* elf, size_t size) {
+    if (size < sizeof(Elf64_Ehdr) || memcmp(elf, ELFMAG, SELFMAG) != 0) {
+        std::cerr << "Not an ELF file" << std::endl;
+        return false;
+    }
+    const Elf64_Ehdr* ehdr = reinterpret_cast<const Elf64_Ehdr*>(elf);
+    if (ehdr->e_ident[EI_CLASS] != ELFCLASS64 || ehdr->e_ident[EI_DATA] != ELFDATA2LSB) {
+        std::cerr << "Only little-endian ELF64 files are supported" << std::endl;
+        return false;
+    }
+    if (ehdr->e_shoff + uint64_t(ehdr->e_shnum) * sizeof(Elf64_Shdr) > size || ehdr->e_shstrndx >= ehdr->e_shnum) {
+        std::cerr << "Section headers are out of bounds" << std::endl;
+        return false;
+    }
+
+    const Elf64_Shdr* shdrs = reinterpret_cast<const Elf64_Shdr*>(elf + ehdr->e_shoff);
+    const Elf64_Shdr &strtab = shdrs[ehdr->e_shstrndx];
+    for (size_t i = 0; i < ehdr->e_shnum; i++) {
+        const Elf64_Shdr &sh = shdrs[i];
+        if (sh.sh_type == SHT_NOBITS || sh.sh_offset + sh.sh_size > size || sh.sh_name >= strtab.sh_size) continue;
+        const char* name = reinterpret_cast<const char*>(elf + strtab.sh_offset + sh.sh_name);
+
+        Section* section = nullptr;
+        if (strcmp(name, ".debug_line") == 0) section = &debug_line;
+        else if (strcmp(name, ".debug_line_str") == 0) section = &debug_line_str;
+        else if (strcmp(name, ".debug_str") == 0) section = &debug_str;
+        if (!section) continue;
+
+        if (sh.sh_flags & SHF_COMPRESSED) {
+            std::cerr << name << " is compressed, relink without --compress-debug-sections" << std::endl;
+            return false;
+        }
+        section->data = elf + sh.sh_offset;
+        section->size = sh.sh_size;
+    }
+
+    if (!debug_line.data) {
+        std::cerr << "No .debug_line section, compile with -g" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Quotes a CSV field the way pandas does, only when it needs it
+static void write_field(FILE* out, const std::string &field) {
+    if (field.find_first_of(",\"\n") == std::string::npos) {
+        fputs(field.c_str(), out);
+        return;
+    }
+    fputc('"', out);
+    for (char c : field) {
+        if (c == '"') fputc('"', out);
+        fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+int main(int argc, char* argv[]) {
+    const char* out_path = nullptr;
+    const char* module = nullptr;
+    int opt;
+    while ((opt = getopt(argc, argv, "o:m:s:")) != -1) {
+        switch (opt) {
+            case 'o': out_path = optarg; break;
+            case 'm': module = optarg; break;
+            case 's': filters.push_back(optarg); break;
+            default:
+                std::cerr << "Usage: " << argv[0] << " [-o out.csv] [-m module] [-s source_filter]... elf_path" << std::endl;
+                return EXIT_FAILURE;
+        }
+    }
+    if (optind != argc - 1) {
+        std::cerr << "Usage: " << argv[0] << " [-o out.csv] [-m module] [-s source_filter]... elf_path" << std::endl;
+        return EXIT_FAILURE;
+    }
+    const char* elf_path = argv[optind];
+    if (!module) {
+        const char* slash = strrchr(elf_path, '/');
+        module = slash ? slash + 1 : elf_path;
+    }
+
+    int fd = open(elf_path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) != 0) {
+        std::cerr << "Failed to open " << elf_path << ": " << strerror(errno) << std::endl;
+        return EXIT_FAILURE;
+    }
+    void* elf = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (elf == MAP_FAILED) {
+        std::cerr << "Failed to map " << elf_path << ": " << strerror(errno) << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (!find_sections(static_cast<const uint8_t*>(elf), st.st_size)) return EXIT_FAILURE;
+
+    Reader r(debug_line.data, debug_line.data + debug_line.size);
+    while (r.ok && r.p < r.end) {
+        if (!decode_unit(r)) {
+            std::cerr << "Malformed line table at offset 0x" << std::hex << (r.p - debug_line.data) << std::dec
+                      << ", ignoring the rest" << std::endl;
+            break;
+        }
+    }
+
+    // Line tables are split by sequence and unit, so merge any ranges of the same line that ended
+    // up adjacent
+    std::stable_sort(ranges.begin(), ranges.end(), [](const Range &a, const Range &b) { return a.offset < b.offset; });
+    std::vector<Range> merged;
+    for (const Range &range : ranges) {
+        if (!merged.empty()) {
+            Range &prev = merged.back();
+            if (prev.file == range.file && prev.line == range.line && prev.offset + prev.size == range.offset) {
+                prev.size += range.size;
+                continue;
+            }
+        }
+        merged.push_back(range);
+    }
+
+    FILE* out = out_path ? fopen(out_path, "w") : stdout;
+    if (!out) {
+        std::cerr << "Failed to open " << out_path << ": " << strerror(errno) << std::endl;
+        return EXIT_FAILURE;
+    }
+    for (const Range &range : merged) {
+        write_field(out, module);
+        fputc(',', out);
+        write_field(out, paths[range.file]);
+        fprintf(out, ",%u,0x%llx,%llu\n", range.line, (unsigned long long)range.offset, (unsigned long long)range.size);
+    }
+    if (out != stdout && fclose(out) != 0) {
+        std::cerr << "Failed to write " << out_path << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,106 @@
+#ifndef IPHISTOGRAM_HPP
+#define IPHISTOGRAM_HPP
+
+#include <cstdint>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+
+#include "modulemap.hpp"
+
+/*
+    Counts how often each instruction pointer is sampled. This is an open-addressing table that
+    never allocates after construction, so add() can run in the SIGPROF handler. Samples that
+    don't fit once the probe limit is hit are counted in `dropped` instead. Each ip is resolved to
+    its module when first seen, so libraries that are dlclosed before the dump are still covered.
+*/
+struct IpHistogram {
+    IpHistogram(const ModuleMap* modules): modules(modules), dropped(0) {
+        entries = new Entry[CAPACITY]();
+    }
+
+    ~IpHistogram() {
+        delete[] entries;
+    }
+
+    void add(uint64_t ip) {
+        size_t index = (ip * 0x9E3779B97F4A7C15ULL) >> (64 - CAPACITY_BITS);
+        for (size_t i = 0; i < MAX_PROBES; i++) {
+            Entry &e = entries[(index + i) & (CAPACITY - 1)];
+            if (e.ip == ip) {
+                e.count++;
+                return;
+            }
+            if (e.count == 0) {
+                e.ip = ip;
+                e.module = modules->find(ip);
+                e.count = 1;
+                return;
+            }
+        }
+        dropped++;
+    }
+
+    void clear() {
+        for (size_t i = 0; i < CAPACITY; i++) entries[i] = Entry();
+        dropped = 0;
+    }
+
+    /**
+        Appends a `module,offset,count` line to `path` for every sampled ip that fell in a loaded
+        module, with the module's path and the offset from its base. Only uses syscalls and
+        snprintf, so it can run during shutdown from a signal handler.
+    */
+    bool dump(const char* path) {
+        int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd == -1) return false;
+        flock(fd, LOCK_EX);
+
+        bool ok = true;
+        char buf[4096];
+        size_t len = 0;
+        for (size_t i = 0; i < CAPACITY && ok; i++) {
+            const Entry &e = entries[i];
+            const Module* m = e.module;
+            if (e.count == 0 || !m) continue;
+
+            int n = snprintf(buf + len, sizeof(buf) - len, "%s,0x%llx,%llu\n", m->path,
+                (unsigned long long)(e.ip - m->base), (unsigned long long)e.count);
+            if (n < 0) continue;
+            if (len + n >= sizeof(buf)) {
+                // Buffer is full, so flush it and start over with this line
+                ok = write(fd, buf, len) == (ssize_t)len;
+                len = 0;
+                n = snprintf(buf, sizeof(buf), "%s,0x%llx,%llu\n", m->path,
+                    (unsigned long long)(e.ip - m->base), (unsigned long long)e.count);
+                if (n < 0 || n >= (int)sizeof(buf)) continue;
+            }
+            len += n;
+        }
+        if (ok && len > 0) ok = write(fd, buf, len) == (ssize_t)len;
+
+        flock(fd, LOCK_UN);
+        close(fd);
+        return ok;
+    }
+
+    size_t get_dropped() { return dropped; }
+
+private:
+    struct Entry {
+        uint64_t ip;
+        uint64_t count;
+        const Module* module;
+    };
+
+    static constexpr size_t CAPACITY_BITS = 16;
+    static constexpr size_t CAPACITY = 1 << CAPACITY_BITS;
+    static constexpr size_t MAX_PROBES = 64;
+
+    Entry* entries;
+    const ModuleMap* modules;
+    size_t dropped;
+};
+
+#endif //IPHISTOGRAM_HPP
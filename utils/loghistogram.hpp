@@ -0,0 +1,63 @@
+#ifndef LOGHISTOGRAM_HPP
+#define LOGHISTOGRAM_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/*
+    HDR-style histogram of non-negative integers. Every power of two is split into SUB_BUCKETS
+    linear buckets, so each count is within 1/SUB_BUCKETS (12.5%) of the value recorded, and
+    values below SUB_BUCKETS are exact. Values of 2^(MAX_EXPONENT+1) and up, about 78 hours in
+    nanoseconds, all land in the last bucket. Buckets are relaxed atomics, so recording is a
+    single lock-free increment from any thread.
+*/
+struct LogHistogram {
+    static constexpr unsigned SUB_BUCKET_BITS = 3;
+    static constexpr size_t SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static constexpr unsigned MAX_EXPONENT = 47;
+    static constexpr size_t BUCKETS = (MAX_EXPONENT - SUB_BUCKET_BITS + 2) * SUB_BUCKETS;
+
+    void record(uint64_t value) {
+        counts[bucket(value)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Adds the counts of `other`, which is cleared or dropped afterwards
+    void merge(const LogHistogram &other) {
+        for (size_t i = 0; i < BUCKETS; i++) {
+            uint64_t count = other.get_count(i);
+            if (count) counts[i].fetch_add(count, std::memory_order_relaxed);
+        }
+    }
+
+    void clear() {
+        for (std::atomic<uint64_t> &count : counts) count.store(0, std::memory_order_relaxed);
+    }
+
+    uint64_t get_count(size_t index) const { return counts[index].load(std::memory_order_relaxed); }
+
+    static size_t bucket(uint64_t value) {
+        if (value < SUB_BUCKETS) return value;
+        unsigned exponent = 63 - __builtin_clzll(value);
+        if (exponent > MAX_EXPONENT) return BUCKETS - 1;
+        return (exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + ((value >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1));
+    }
+
+    // Smallest value in bucket `index`
+    static uint64_t lower_bound(size_t index) {
+        if (index < SUB_BUCKETS) return index;
+        unsigned exponent = index / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+        return (SUB_BUCKETS + index % SUB_BUCKETS) << (exponent - SUB_BUCKET_BITS);
+    }
+
+    // Largest value in bucket `index`
+    static uint64_t upper_bound(size_t index) {
+        if (index == BUCKETS - 1) return UINT64_MAX;
+        return lower_bound(index + 1) - 1;
+    }
+
+private:
+    std::atomic<uint64_t> counts[BUCKETS] = {};
+};
+
+#endif //LOGHISTOGRAM_HPP
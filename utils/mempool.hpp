@@ -2,6 +2,7 @@
 #define MEMPOOL_H
 
 #include <list>
+#include <atomic>
 
 struct MemoryPoolBuffer {
     char* buffer;
@@ -18,7 +19,7 @@ struct MemoryPoolBuffer {
 };
 
 struct MemoryPool {
-    MemoryPool(size_t size, size_t buf_len): head(nullptr) {
+    MemoryPool(size_t size, size_t buf_len): head(nullptr), buf_len(buf_len), size(size), nfree(0) {
         for (int i = 0; i < size; i++) {
             return_buf(new MemoryPoolBuffer(buf_len));
         }
@@ -27,16 +28,26 @@ struct MemoryPool {
     void return_buf(MemoryPoolBuffer* buf) {
         buf->next = head;
         head = buf;
+        nfree.fetch_add(1, std::memory_order_relaxed);
     }
 
+    // Grows the pool by one buffer when it is empty, so a burst of packets never runs it dry
     MemoryPoolBuffer* get_buf() {
         MemoryPoolBuffer* buf = head;
-        if (buf) {
-            head = buf->next;
+        if (!buf) {
+            size.fetch_add(1, std::memory_order_relaxed);
+            return new MemoryPoolBuffer(buf_len);
         }
+        head = buf->next;
+        nfree.fetch_sub(1, std::memory_order_relaxed);
         return buf;
     }
 
+    size_t get_size() { return size.load(std::memory_order_relaxed); }
+
+    // Safe to read from other threads, e.g. for metrics
+    size_t get_free() { return nfree.load(std::memory_order_relaxed); }
+
     // Note: This only cleans up buffers currently in the pool.
     // If buffers are checked out and not returned, they are leaked
     // unless the user manually deletes them.
@@ -51,6 +62,9 @@ struct MemoryPool {
 
 private:
     MemoryPoolBuffer* head;
+    size_t buf_len;
+    std::atomic<size_t> size;
+    std::atomic<size_t> nfree;
 };
 
 #endif //MEMPOOL_H
@@ -0,0 +1,121 @@
+#ifndef MODULEMAP_HPP
+#define MODULEMAP_HPP
+
+#include <link.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+struct Module {
+    uintptr_t start;
+    uintptr_t end;
+    // Load bias of the object, so offsets in the ELF file are at base + offset
+    uintptr_t base;
+    const char* path;
+};
+
+/*
+    Executable segments of every loaded object, sorted by address. refresh() rebuilds the table
+    from dl_iterate_phdr and publishes it with an atomic pointer swap, so lookups never lock and
+    can run in the SIGPROF handler. A handler may still be reading the old table when it is
+    replaced, so retired tables are never freed. That costs one small table per refresh, which
+    happens each time the profiled thread maps in code.
+*/
+struct ModuleMap {
+    ModuleMap(): table(nullptr) {
+        pthread_mutex_init(&refresh_lock, nullptr);
+    }
+
+    // Rebuilds the table. Returns false if no modules were found
+    bool refresh() {
+        pthread_mutex_lock(&refresh_lock);
+        std::vector<Module> modules;
+        dl_iterate_phdr(collect_callback, &modules);
+        std::sort(modules.begin(), modules.end(), [](const Module &a, const Module &b) { return a.start < b.start; });
+
+        Table* old_table = table.load();
+        Table* new_table = new Table { modules.size(), new Module[modules.size()] };
+        for (size_t i = 0; i < modules.size(); i++) {
+            new_table->modules[i] = modules[i];
+            new_table->modules[i].path = intern_path(old_table, new_table, i);
+        }
+        table.store(new_table);
+        pthread_mutex_unlock(&refresh_lock);
+        return !modules.empty();
+    }
+
+    // Returns the module whose executable code contains `ip`, or nullptr
+    const Module* find(uintptr_t ip) const {
+        const Table* t = table.load(std::memory_order_acquire);
+        if (!t) return nullptr;
+        const Module* end = t->modules + t->count;
+        const Module* m = std::upper_bound(static_cast<const Module*>(t->modules), end, ip, [](uintptr_t ip, const Module &m) { return ip < m.start; });
+        if (m == t->modules) return nullptr;
+        m--;
+        return ip < m->end ? m : nullptr;
+    }
+
+    // Returns the first module whose path contains `name`, or nullptr
+    const Module* find_by_name(const char* name) const {
+        const Table* t = table.load(std::memory_order_acquire);
+        if (!t) return nullptr;
+        for (size_t i = 0; i < t->count; i++) {
+            if (strstr(t->modules[i].path, name)) return &t->modules[i];
+        }
+        return nullptr;
+    }
+
+private:
+    struct Table {
+        size_t count;
+        Module* modules;
+    };
+
+    static int collect_callback(struct dl_phdr_info* info, size_t, void* data) {
+        std::vector<Module>* modules = static_cast<std::vector<Module>*>(data);
+
+        // The main program has an empty name
+        const char* path = info->dlpi_name;
+        if (!path || path[0] == '\0') path = exe_path();
+
+        for (size_t i = 0; i < info->dlpi_phnum; i++) {
+            const ElfW(Phdr) &phdr = info->dlpi_phdr[i];
+            if (phdr.p_type != PT_LOAD || !(phdr.p_flags & PF_X)) continue;
+            uintptr_t start = info->dlpi_addr + phdr.p_vaddr;
+            modules->push_back({ start, start + phdr.p_memsz, info->dlpi_addr, path });
+        }
+        return 0;
+    }
+
+    static const char* exe_path() {
+        static char exe[4096];
+        if (exe[0] == '\0') {
+            ssize_t len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+            exe[len > 0 ? len : 0] = '\0';
+        }
+        return exe;
+    }
+
+    // dlpi_name belongs to the loader and goes away on dlclose, so keep our own copy. Paths are
+    // reused from earlier segments and the previous table, which is never freed, so each object
+    // is copied only once.
+    static const char* intern_path(const Table* old_table, const Table* new_table, size_t index) {
+        const char* path = new_table->modules[index].path;
+        for (size_t i = 0; i < index; i++) {
+            if (strcmp(new_table->modules[i].path, path) == 0) return new_table->modules[i].path;
+        }
+        for (size_t i = 0; old_table && i < old_table->count; i++) {
+            if (strcmp(old_table->modules[i].path, path) == 0) return old_table->modules[i].path;
+        }
+        return strdup(path);
+    }
+
+    std::atomic<Table*> table;
+    pthread_mutex_t refresh_lock;
+};
+
+#endif //MODULEMAP_HPP
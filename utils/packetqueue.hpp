@@ -1,16 +1,17 @@
 #ifndef PACKETQUEUE_HPP
 #define PACKETQUEUE_HPP
 
-#include <ctime>
 #include <stdexcept>
 
 #include "mempool.hpp"
+#include "time.hpp"
 
 struct Packet {
     MemoryPoolBuffer *buffer;
     size_t len;
     size_t nread;
-    timespec wakeup_time;
+    time_ns arrival_time;
+    time_ns wakeup_time;
 };
 
 struct PacketQueue {
@@ -19,6 +20,8 @@ struct PacketQueue {
 
     size_t get_size() { return size; }
 
+    static constexpr size_t get_capacity() { return BUFFER_SIZE; }
+
     Packet* get_head() { return &ring_buffer[head]; }
 
     void push(Packet packet) {
@@ -0,0 +1,102 @@
+#ifndef RESULTS_HPP
+#define RESULTS_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+/*
+    Experiment results from every run are appended to one file as fixed-size records:
+
+        ResultsHeader | ResultRecord | ResultRecord | ...
+
+    All fields are naturally aligned, so readers can mmap everything after the header as an
+    array of records (see read_results in run_dcuz_experiments.py). Bump RESULTS_VERSION
+    whenever the layout changes.
+*/
+constexpr char RESULTS_MAGIC[8] = {'D', 'C', 'U', 'Z', 'R', 'E', 'S', '\0'};
+constexpr uint32_t RESULTS_VERSION = 5;
+constexpr size_t RESULTS_MODULE_LEN = 64;
+constexpr size_t RESULTS_MAX_THREADS = 14;
+
+struct ResultsHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t record_size;
+    uint32_t reserved;
+};
+
+struct ThreadResult {
+    uint64_t tid;
+    uint64_t hit_counts;
+    uint64_t profile_counts;
+};
+
+struct ResultRecord {
+    uint64_t pid;
+    // DCUZ_RUN_ID, shared by every process of one run, so a run finds its records after pids wrap
+    uint64_t run_id;
+    char module[RESULTS_MODULE_LEN];
+    uint64_t offset;
+    double speedup;
+    uint64_t hit_counts;
+    uint64_t profile_counts;
+    uint64_t delayed_ns;
+    uint64_t runtime_ns;
+    uint32_t nthreads;
+    uint32_t size;
+    // Both attributions are always counted, hit_counts is the one that was delayed
+    uint64_t self_hits;
+    uint64_t inclusive_hits;
+    uint32_t attribution;
+    uint32_t callchain_depth;
+    // Time spent in DCuz's own hooks and sample handling, summed over threads (see overhead.hpp)
+    uint64_t overhead_ns;
+    uint64_t overhead_spans;
+    uint64_t overhead_span_cost_ns;
+    ThreadResult threads[RESULTS_MAX_THREADS];
+};
+
+static_assert(sizeof(ResultsHeader) == 24, "ResultsHeader layout changed");
+static_assert(sizeof(ResultRecord) == 520, "ResultRecord layout changed");
+
+/**
+    Appends `record` to the results file at `path`, writing the header first if the file is new.
+    Writers are serialized with flock, and each record goes out in a single O_APPEND write, so
+    concurrent runs can share one file. Returns false if the file can't be written or was
+    written by a different schema version.
+*/
+inline bool append_result(const char* path, const ResultRecord &record) {
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1) return false;
+
+    bool ok = false;
+    struct stat st;
+    if (flock(fd, LOCK_EX) == 0 && fstat(fd, &st) == 0) {
+        if (st.st_size == 0) {
+            ResultsHeader header;
+            memset(&header, 0, sizeof(header));
+            memcpy(header.magic, RESULTS_MAGIC, sizeof(RESULTS_MAGIC));
+            header.version = RESULTS_VERSION;
+            header.header_size = sizeof(ResultsHeader);
+            header.record_size = sizeof(ResultRecord);
+            ok = write(fd, &header, sizeof(header)) == sizeof(header);
+        } else {
+            ResultsHeader header;
+            ok = pread(fd, &header, sizeof(header), 0) == sizeof(header)
+                && memcmp(header.magic, RESULTS_MAGIC, sizeof(RESULTS_MAGIC)) == 0
+                && header.version == RESULTS_VERSION
+                && header.record_size == sizeof(ResultRecord);
+        }
+        if (ok) ok = write(fd, &record, sizeof(record)) == sizeof(record);
+        flock(fd, LOCK_UN);
+    }
+    close(fd);
+    return ok;
+}
+
+#endif //RESULTS_HPP
@@ -1,39 +1,138 @@
 #ifndef TIME_H
 #define TIME_H
 
+#include <dlfcn.h>
 #include <ctime>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+/*
+    Time in the hooks is a plain count of CLOCK_MONOTONIC nanoseconds, so deadlines are compared
+    and shifted with integer arithmetic. now_ns() reads the TSC and scales it into that clock when
+    the CPU has an invariant TSC and calibrate_clock() has run, and otherwise falls back to
+    clock_gettime (served from the vDSO).
+
+    The scale is fixed at calibration, so the two clocks drift apart by the TSC's frequency error
+    (tens of ppm) over a run. That is well below the delays being added.
+
+    DCuz may interpose clock_gettime and clock_nanosleep to show the application virtual time
+    (see time_hook.cpp), so everything here goes straight to libc's, and our own code must sleep
+    through sleep_until/sleep_for rather than calling clock_nanosleep.
+*/
+typedef uint64_t time_ns;
 
 #define BILLION 1000000000L
-inline void add_ns(timespec *t, long ns) {
-    time_t add_sec = ns / BILLION;
-    ns = ns % BILLION;
 
-    t->tv_nsec += ns;
-    add_sec += t->tv_nsec / BILLION;
-    t->tv_nsec = t->tv_nsec % BILLION;
-    t->tv_sec += add_sec;
+typedef int(*clock_gettime_t)(clockid_t clockid, timespec* tp);
+typedef int(*clock_nanosleep_t)(clockid_t clockid, int flags, const timespec* request, timespec* remain);
+
+inline clock_gettime_t real_clock_gettime = nullptr;
+inline clock_nanosleep_t real_clock_nanosleep = nullptr;
+
+inline void initialize_real_clock() {
+    if (real_clock_gettime) return;
+    real_clock_nanosleep = (clock_nanosleep_t) dlsym(RTLD_NEXT, "clock_nanosleep");
+    real_clock_gettime = (clock_gettime_t) dlsym(RTLD_NEXT, "clock_gettime");
+}
+
+struct TscCalibration {
+    bool enabled;
+    uint64_t base_ticks;
+    time_ns base_ns;
+    // Nanoseconds per tick as a 32.32 fixed point number
+    uint64_t mult;
+};
+
+inline TscCalibration tsc_calibration = { false, 0, 0, 0 };
+
+inline time_ns monotonic_ns() {
+    initialize_real_clock();
+    timespec ts;
+    real_clock_gettime(CLOCK_MONOTONIC, &ts);
+    return time_ns(ts.tv_sec) * BILLION + ts.tv_nsec;
+}
+
+inline timespec to_timespec(time_ns t) {
+    return { time_t(t / BILLION), long(t % BILLION) };
+}
+
+inline time_ns from_timespec(const timespec &t) {
+    return time_ns(t.tv_sec) * BILLION + t.tv_nsec;
+}
+
+// Sleeps until `deadline` on CLOCK_MONOTONIC. Returns the clock_nanosleep error, e.g. EINTR.
+inline int sleep_until(time_ns deadline) {
+    initialize_real_clock();
+    timespec ts = to_timespec(deadline);
+    return real_clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr);
+}
+
+inline int sleep_for(time_ns duration) {
+    initialize_real_clock();
+    timespec ts = to_timespec(duration);
+    return real_clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, nullptr);
 }
 
 /**
-    Returns true a <= b.
+    Raw ticks of the fastest clock available, for timing short spans. Only meaningful as a
+    difference, converted with ticks_to_ns().
 */
-inline bool time_passed(const timespec &a, const timespec &b) {
-    return a.tv_sec < b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec <= b.tv_nsec);
+inline uint64_t now_ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+    if (tsc_calibration.enabled) return __rdtsc();
+#endif
+    return monotonic_ns();
+}
+
+inline time_ns ticks_to_ns(uint64_t ticks) {
+    if (!tsc_calibration.enabled) return ticks;
+    return time_ns((unsigned __int128)ticks * tsc_calibration.mult >> 32);
+}
+
+inline time_ns now_ns() {
+    if (!tsc_calibration.enabled) return monotonic_ns();
+    return tsc_calibration.base_ns + ticks_to_ns(now_ticks() - tsc_calibration.base_ticks);
+}
+
+// Only a TSC that ticks at a constant rate in every power state can be converted to time
+inline bool has_invariant_tsc() {
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)) return false;
+    return edx & (1 << 8);
+#else
+    return false;
+#endif
 }
 
 /**
-    Returns a - b. Assumes a > b.
+    Measures the TSC against CLOCK_MONOTONIC over `window_ns`, and switches now_ns() over to it.
+    Call once at startup, before any other threads read the clock. Returns false if there is no
+    usable TSC, in which case now_ns() keeps using clock_gettime.
 */
-inline timespec time_diff(const timespec &a, const timespec &b) {
-    time_t sec_diff = a.tv_sec - b.tv_sec;
-    long nsec_diff = 0;
-    if (a.tv_nsec < b.tv_nsec) {
-        sec_diff -= 1;
-        nsec_diff = BILLION + a.tv_nsec - b.tv_nsec;
-    } else {
-        nsec_diff = a.tv_nsec - b.tv_nsec;
-    }
-    return { sec_diff, nsec_diff };
+inline bool calibrate_clock(time_ns window_ns = 10000000) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (!has_invariant_tsc()) return false;
+
+    time_ns start_ns = monotonic_ns();
+    uint64_t start_ticks = __rdtsc();
+    sleep_for(window_ns);
+    time_ns end_ns = monotonic_ns();
+    uint64_t end_ticks = __rdtsc();
+    if (end_ticks <= start_ticks) return false;
+
+    tsc_calibration.mult = ((unsigned __int128)(end_ns - start_ns) << 32) / (end_ticks - start_ticks);
+    tsc_calibration.base_ticks = end_ticks;
+    tsc_calibration.base_ns = end_ns;
+    tsc_calibration.enabled = true;
+    return true;
+#else
+    return false;
+#endif
 }
 
 #endif //TIME_H
@@ -0,0 +1,47 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <cstdint>
+
+/*
+    Traces of the inbound traffic on every tracked connection, as recorded with DCUZ_RECORD and
+    played back with DCUZ_REPLAY (see replay.hpp):
+
+        TraceHeader | TraceEvent payload | TraceEvent payload | ...
+
+    Each event is followed by `len` bytes of payload. Times are nanoseconds since recording
+    started. A connection's TRACE_CONNECT or TRACE_ACCEPT event comes before its data, but events
+    of different connections are not sorted by time. Bump TRACE_VERSION whenever the layout
+    changes.
+*/
+constexpr char TRACE_MAGIC[8] = {'D', 'C', 'U', 'Z', 'T', 'R', 'C', '\0'};
+constexpr uint32_t TRACE_VERSION = 1;
+
+struct TraceHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+};
+
+enum TraceEventType : uint16_t {
+    // We connected to a peer. The payload is the peer's sockaddr.
+    TRACE_CONNECT = 1,
+    // A peer connected to us. The payload is the sockaddr we were listening on.
+    TRACE_ACCEPT = 2,
+    // Bytes read from the connection exactly as they arrived, framing and metadata included
+    TRACE_DATA = 3,
+    // The peer closed the connection
+    TRACE_EOF = 4,
+};
+
+struct TraceEvent {
+    uint64_t time_ns;
+    uint32_t conn;
+    uint16_t type;
+    uint16_t len;
+};
+
+static_assert(sizeof(TraceHeader) == 16, "TraceHeader layout changed");
+static_assert(sizeof(TraceEvent) == 16, "TraceEvent layout changed");
+
+#endif //TRACE_HPP